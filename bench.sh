@@ -0,0 +1,64 @@
+#!/bin/bash
+
+# compara os transportes entre nodes com o caminho saturado: o cliente no modo carga mantem uma janela
+# grande de PUTs em voo e os nodes relatam a cada segundo (PAXOS_STATS_MS) as mensagens que o transporte
+# levou e trouxe e os comandos aplicados
+# uso: ./bench.sh [comandos] [rodadas] [transportes...]   (padrao: 30000 comandos, 3 rodadas, tcp e uring)
+# as outras variaveis PAXOS_* do ambiente passam direto para os nodes (PAXOS_WINDOW padrao aqui: 64)
+
+n=${1:-30000}
+rodadas=${2:-3}
+shift; shift
+transportes=${*:-tcp uring}
+export PAXOS_SM=kv PAXOS_STATS_MS=1000 PAXOS_WINDOW=${PAXOS_WINDOW:-64}
+
+echo "compilando client.c e node1-5.c"
+gcc -O2 -o client client.c || exit 1
+for i in 1 2 3 4 5; do
+    gcc -O2 -o node$i node$i.c -lpthread || exit 1
+done
+
+# media das linhas de relatorio de um log a partir da linha $2, sem a primeira e a ultima (segundos
+# pela metade); imprime "mensagens recebidas/s comandos aplicados/s"
+media() {
+    tail -n +"$2" "$1" | awk '
+        / transporte .* recebidas\/s/ { r[nr++] = $(NF-1) }
+        / comandos aplicados\/s/ { c[nc++] = $5 }
+        END {
+            sr = 0; sc = 0
+            for (i = 1; i < nr - 1; i++) sr += r[i]
+            for (i = 1; i < nc - 1; i++) sc += c[i]
+            mr = nr > 2 ? sr / (nr - 2) : 0
+            mc = nc > 2 ? sc / (nc - 2) : 0
+            printf "%d %d\n", mr, mc
+        }'
+}
+
+for t in $transportes; do
+    for rodada in $(seq "$rodadas"); do
+        # cada rodada comeca do zero, como no main.c
+        rm -f "${PAXOS_WAL_DIR:-.}"/paxos_wal_*.log "${PAXOS_WAL_DIR:-.}"/paxos_log_*.seg "${PAXOS_WAL_DIR:-.}"/paxos_snap_*
+        rm -f /dev/shm/paxos_shm
+        pids=""
+        for i in 1 2 3 4 5; do
+            PAXOS_TRANSPORT=$t ./node$i > bench_node$i.log 2>&1 &
+            pids="$pids $!"
+        done
+        sleep 3 # eleicao
+        declare -A inicio
+        for i in 1 2 3 4 5; do inicio[$i]=$(($(wc -l < bench_node$i.log) + 1)); done
+        cliente=$(./client carga "$n" | grep "carga:")
+        kill $pids 2> /dev/null
+        wait $pids 2> /dev/null
+        msgs=0
+        cmds=0
+        for i in 1 2 3 4 5; do
+            read -r m c < <(media bench_node$i.log "${inicio[$i]}")
+            msgs=$((msgs + m))
+            [ "$c" -gt "$cmds" ] && cmds=$c
+        done
+        echo "transporte $t, rodada $rodada: $msgs mensagens/s entre nodes, $cmds comandos aplicados/s"
+        echo "  $cliente"
+    done
+done
+rm -f bench_node*.log /dev/shm/paxos_shm
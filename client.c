@@ -7,6 +7,9 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/select.h>
 
 
 
@@ -14,15 +17,125 @@
 #define CLIENT_PORT  7000    // porta para receber id do lider
 #define INTERVAL     6       // intervalo entre envios de propostas
 #define MONITOR_PORT 6000
+#define WIRE_VERSION 3       // mesmo formato de quadro dos nodes
+#define MAX_FRAME    1024
+#define CARGA_CONEXOES 8     // conexoes abertas pelo modo carga
+#define CARGA_JANELA 1024    // PUTs em voo sem resultado no modo carga
 
-enum msg_type { CLIENT_PROPOSE = 1000, CLIENT_OK };
+// os valores sao os codigos usados no fio, iguais aos dos nodes
+enum msg_type { CLIENT_PROPOSE = 1000, CLIENT_OK = 1001, CLIENT_LEADER = 1002, CLIENT_BUSY = 1003,
+                CLIENT_READ = 1004, CLIENT_VALUE = 1005, CLIENT_KV = 1006, CLIENT_RESULT = 1007 };
+
+// operacoes e resultados da maquina chave-valor dos nodes (PAXOS_SM=kv)
+enum kv_op { KV_GET = 1, KV_PUT = 2, KV_DELETE = 3, KV_CAS = 4 };
+enum sm_status { SM_OK = 0, SM_NOT_FOUND = 1, SM_CAS_FAILED = 2 };
 
 // estrutura de mensagem usada para enviar propostas e receber confirmacoes
+// origin, num e slot so sao usados pelos comandos chave-valor
 typedef struct msg {
     int type;
     int value;
+    int origin;
+    int num;
+    int slot;
 } msg;
 
+// formato no fio, o mesmo dos nodes:
+//   quadro   = versao (1 byte) | tamanho do conteudo (varint) | conteudo
+//   conteudo = quantidade de mensagens (varint) | mensagens
+//   mensagem = tipo | origem | numero da proposta | valor | instancia | grupo, cada campo um varint (zigzag nos com sinal)
+
+// escreve v em grupos de 7 bits, bit alto ligado indica que vem mais byte
+size_t put_varint(char *dst, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        dst[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    dst[n++] = (char)v;
+    return n;
+}
+
+// le um varint, retorna quantos bytes usou ou 0 se estiver incompleto ou for invalido
+size_t get_varint(const char *src, size_t len, uint32_t *v) {
+    uint32_t r = 0;
+    for (size_t i = 0; i < len && i < 5; i++) {
+        uint8_t b = (uint8_t)src[i];
+        r |= (uint32_t)(b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+            *v = r;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+int32_t unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// envia um quadro com uma mensagem do cliente (sem grupo, o node acha pela chave)
+int send_frame(int fd, msg *m) {
+    char body[40], frame[48];
+    size_t blen = put_varint(body, 1);
+    blen += put_varint(body + blen, (uint32_t)m->type);
+    blen += put_varint(body + blen, zigzag(m->origin));
+    blen += put_varint(body + blen, zigzag(m->num));
+    blen += put_varint(body + blen, zigzag(m->value));
+    blen += put_varint(body + blen, zigzag(m->slot));
+    blen += put_varint(body + blen, zigzag(0));
+    size_t off = 0;
+    frame[off++] = WIRE_VERSION;
+    off += put_varint(frame + off, (uint32_t)blen);
+    memcpy(frame + off, body, blen);
+    off += blen;
+    return write(fd, frame, off) == (ssize_t)off ? 0 : -1;
+}
+
+// le exatamente len bytes, retorna -1 se a conexao fechou antes
+int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// le um quadro de um node e devolve a primeira mensagem dele
+int read_frame(int fd, msg *m) {
+    char hdr[6], body[MAX_FRAME];
+    size_t h = 0, off;
+    uint32_t blen = 0, f[6];
+    if (read_full(fd, hdr, 1) < 0 || (uint8_t)hdr[0] != WIRE_VERSION) return -1;
+    do {
+        if (h >= 5 || read_full(fd, hdr + 1 + h, 1) < 0) return -1;
+        h++;
+    } while (hdr[h] & 0x80);
+    if (get_varint(hdr + 1, h, &blen) == 0 || blen > MAX_FRAME) return -1;
+    if (read_full(fd, body, blen) < 0) return -1;
+    // quantidade, tipo, origem, numero da proposta, valor, instancia
+    off = 0;
+    for (int i = 0; i < 6; i++) {
+        size_t k = get_varint(body + off, blen - off, &f[i]);
+        if (k == 0) return -1;
+        off += k;
+    }
+    m->type = (int)f[1];
+    m->origin = unzigzag(f[2]);
+    m->num = unzigzag(f[3]);
+    m->value = unzigzag(f[4]);
+    m->slot = unzigzag(f[5]);
+    return 0;
+}
+
 // aguarda receber o id do node lider via conexao tcp
 int receive_leader() {
     int srv = socket(AF_INET, SOCK_STREAM, 0);
@@ -38,10 +151,11 @@ int receive_leader() {
     printf("[client] aguardando lider na porta %d...\n", CLIENT_PORT);
     int c = accept(srv, NULL, NULL);
     if (c < 0) { perror("accept"); exit(1); }
-    int leader_id;
-    if (read(c, &leader_id, sizeof(leader_id)) != sizeof(leader_id)) {
+    msg lm;
+    if (read_frame(c, &lm) < 0 || lm.type != CLIENT_LEADER) {
         fprintf(stderr, "[client] erro lendo lider\n"); exit(1);
     }
+    int leader_id = lm.value;
     close(c);
     close(srv);
     printf("[client] lider eleito: %d\n", leader_id);
@@ -63,10 +177,11 @@ int receive_new_leader() {
     printf("[client] aguardando novo lider na porta %d...\n", CLIENT_PORT);
     int c = accept(srv, NULL, NULL);
     if (c < 0) { perror("accept"); exit(1); }
-    int leader_id;
-    if (read(c, &leader_id, sizeof(leader_id)) != sizeof(leader_id)) {
+    msg lm;
+    if (read_frame(c, &lm) < 0 || lm.type != CLIENT_LEADER) {
         fprintf(stderr, "[client] erro lendo novo lider\n"); exit(1);
     }
+    int leader_id = lm.value;
     close(c);
     close(srv);
     printf("[client] novo lider eleito: %d\n", leader_id);
@@ -93,10 +208,236 @@ void timestamp(char *buf, size_t sz) {
     snprintf(buf + strlen(buf), sz - strlen(buf), ".%03d", ms);
 }
 
+// le o ultimo valor decidido no grupo da chave direto do lider, que responde pelo lease sem rodada de paxos
+// node que nao lidera o grupo responde CLIENT_LEADER e a leitura vai para o lider indicado
+// retorna -1 se o lider recusou (ainda sem lease) ou nao respondeu
+int lease_read(int node, int key, int *val) {
+    for (int tentativa = 0; tentativa < 2; tentativa++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = { .sin_family = AF_INET,
+            .sin_port = htons(BASE_PORT + 100 + node),
+            .sin_addr.s_addr = inet_addr("127.0.0.1") };
+        msg resp = { 0 };
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            msg m = { .type = CLIENT_READ, .value = key };
+            send_frame(sock, &m);
+            shutdown(sock, SHUT_WR);
+            if (read_frame(sock, &resp) < 0) resp.type = 0;
+        }
+        close(sock);
+        if (resp.type == CLIENT_VALUE) {
+            *val = resp.value;
+            return 0;
+        }
+        if (resp.type != CLIENT_LEADER) break;
+        node = resp.value;
+    }
+    return -1;
+}
+
+// abre a porta de confirmacao (CLIENT_PORT+1), onde chegam os resultados dos comandos que passaram pelo log
+int open_ack_server() {
+    int ack_srv = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    setsockopt(ack_srv, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in csin = { .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons(CLIENT_PORT+1) };
+    if (bind(ack_srv, (struct sockaddr *)&csin, sizeof(csin)) < 0) {
+        perror("bind ack"); exit(1);
+    }
+    listen(ack_srv, SOMAXCONN);
+    return ack_srv;
+}
+
+// conecta na porta de clientes de um node, retorna -1 se nao conseguiu
+int node_connect(int node) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET,
+        .sin_port = htons(BASE_PORT + 100 + node),
+        .sin_addr.s_addr = inet_addr("127.0.0.1") };
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// manda um comando chave-valor e espera o resultado: GET com lease volta na propria conexao, os demais
+// passam pelo log e quem propos responde na porta de confirmacao (ack_srv, aberta antes do envio)
+// node que nao lidera o grupo da chave responde CLIENT_LEADER e o comando vai para o lider indicado
+// retorna -1 se ninguem respondeu
+int kv_command(int *node, int ack_srv, int op, int key, int value, int expected, msg *res) {
+    for (int tentativa = 0; tentativa < 5; tentativa++) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = { .sin_family = AF_INET,
+            .sin_port = htons(BASE_PORT + 100 + *node),
+            .sin_addr.s_addr = inet_addr("127.0.0.1") };
+        msg resp = { 0 };
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            msg m = { .type = CLIENT_KV, .value = key, .origin = op, .num = value, .slot = expected };
+            send_frame(sock, &m);
+            shutdown(sock, SHUT_WR);
+            if (read_frame(sock, &resp) < 0) resp.type = 0;
+        } else {
+            perror("[client] connect");
+        }
+        close(sock);
+        if (resp.type == CLIENT_LEADER) {
+            *node = resp.value;
+            continue;
+        }
+        if (resp.type == CLIENT_BUSY) {
+            sleep(1);
+            continue;
+        }
+        if (resp.type == CLIENT_RESULT) {
+            *res = resp;
+            return 0;
+        }
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(ack_srv, &fds);
+        struct timeval tv = {8, 0};
+        if (select(ack_srv + 1, &fds, NULL, NULL, &tv) <= 0) return -1;
+        int c = accept(ack_srv, NULL, NULL);
+        int r = c >= 0 && read_frame(c, res) == 0 && res->type == CLIENT_RESULT ? 0 : -1;
+        if (c >= 0) close(c);
+        return r;
+    }
+    return -1;
+}
+
+// modo chave-valor (./client kv [comandos] [node]): GET, PUT, DELETE e CAS numa chave e depois
+// comandos PUT seguidos para medir quantos comandos por segundo o cliente ve confirmados
+int kv_main(int n, int node) {
+    int ack_srv = open_ack_server();
+
+    static const char *nomes[] = { "?", "GET", "PUT", "DELETE", "CAS" };
+    int roteiro[][4] = {   // operacao, chave, valor, esperado
+        { KV_PUT, 10, 1, 0 }, { KV_GET, 10, 0, 0 }, { KV_CAS, 10, 2, 1 }, { KV_CAS, 10, 3, 1 },
+        { KV_GET, 10, 0, 0 }, { KV_DELETE, 10, 0, 0 }, { KV_GET, 10, 0, 0 } };
+    for (size_t i = 0; i < sizeof(roteiro) / sizeof(roteiro[0]); i++) {
+        int *c = roteiro[i];
+        msg r;
+        if (kv_command(&node, ack_srv, c[0], c[1], c[2], c[3], &r) < 0) {
+            printf("[client] %s %d sem resposta\n", nomes[c[0]], c[1]);
+            continue;
+        }
+        printf("[client] %s %d: status %d, valor %d\n", nomes[c[0]], c[1], r.num, r.value);
+    }
+
+    struct timeval t0, t1;
+    gettimeofday(&t0, NULL);
+    int ok = 0;
+    for (int i = 0; i < n; i++) {
+        msg r;
+        if (kv_command(&node, ack_srv, KV_PUT, i, i * 2, 0, &r) == 0 && r.num == SM_OK) ok++;
+    }
+    gettimeofday(&t1, NULL);
+    long ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_usec - t0.tv_usec) / 1000;
+    if (n > 0) printf("[client] %d de %d PUTs confirmados em %ld ms (%.0f comandos/s)\n", ok, n, ms, ok * 1000.0 / (ms > 0 ? ms : 1));
+    close(ack_srv);
+    return 0;
+}
+
+// modo carga (./client carga [comandos] [janela] [node]): PUTs seguidos em CARGA_CONEXOES conexoes abertas,
+// sem esperar o resultado de cada um, ate janela comandos em voo; serve para saturar o caminho entre os nodes
+// (a vazao que conta e a do relatorio PAXOS_STATS_MS dos nodes, aqui sai so o total que o cliente viu)
+// as chaves precisam ser do grupo do node: use um grupo so ou PAXOS_MENCIUS=1
+int carga_main(int n, int janela, int node) {
+    int ack_srv = open_ack_server();
+    msg r;
+    // um PUT comum antes acha o lider (segue o CLIENT_LEADER)
+    if (kv_command(&node, ack_srv, KV_PUT, 0, 0, 0, &r) < 0) {
+        printf("[client] carga: node %d nao respondeu\n", node);
+        return 1;
+    }
+    int conns[CARGA_CONEXOES];
+    for (int i = 0; i < CARGA_CONEXOES; i++) conns[i] = -1;
+    int confirmados = 0, recusados = 0, perdidos = 0, em_voo = 0, chave = 1;
+    struct timeval t0, t1, ultimo;
+    gettimeofday(&t0, NULL);
+    ultimo = t0;
+    while (confirmados < n) {
+        fd_set rd, wr;
+        FD_ZERO(&rd);
+        FD_ZERO(&wr);
+        FD_SET(ack_srv, &rd);
+        int maxfd = ack_srv;
+        int enviar = em_voo < janela && confirmados + em_voo < n;
+        for (int i = 0; i < CARGA_CONEXOES; i++) {
+            if (conns[i] < 0) conns[i] = node_connect(node);
+            if (conns[i] < 0) continue;
+            FD_SET(conns[i], &rd);
+            if (enviar) FD_SET(conns[i], &wr);
+            if (conns[i] > maxfd) maxfd = conns[i];
+        }
+        struct timeval tv = {1, 0};
+        int s = select(maxfd + 1, &rd, &wr, NULL, &tv);
+        gettimeofday(&t1, NULL);
+        long parado = (t1.tv_sec - ultimo.tv_sec) * 1000 + (t1.tv_usec - ultimo.tv_usec) / 1000;
+        if (s <= 0) {
+            // resultado que nao veio em 2 s foi descartado (fila de respostas do node cheia): libera a janela
+            if (parado > 2000) {
+                perdidos += em_voo;
+                em_voo = 0;
+            }
+            if (parado > 10000) break;
+            continue;
+        }
+        if (FD_ISSET(ack_srv, &rd)) {
+            int c = accept(ack_srv, NULL, NULL);
+            if (c >= 0 && read_frame(c, &r) == 0 && r.type == CLIENT_RESULT) {
+                confirmados++;
+                if (em_voo > 0) em_voo--;
+                ultimo = t1;
+            }
+            if (c >= 0) close(c);
+        }
+        for (int i = 0; i < CARGA_CONEXOES; i++) {
+            if (conns[i] < 0 || !FD_ISSET(conns[i], &rd)) continue;
+            if (read_frame(conns[i], &r) < 0) {
+                close(conns[i]);
+                conns[i] = -1;
+            } else if (r.type == CLIENT_BUSY) {
+                recusados++; // o node ja esperou PROPOSAL_WAIT_MS, o proximo PUT ocupa o lugar
+                if (em_voo > 0) em_voo--;
+            } else if (r.type == CLIENT_LEADER && r.value != node) {
+                printf("[client] carga: lider mudou para o node %d\n", r.value);
+                node = r.value;
+                for (int k = 0; k < CARGA_CONEXOES; k++) {
+                    if (conns[k] >= 0) close(conns[k]);
+                    conns[k] = -1;
+                }
+                break;
+            }
+        }
+        for (int i = 0; i < CARGA_CONEXOES; i++) {
+            if (conns[i] < 0 || !FD_ISSET(conns[i], &wr) || em_voo >= janela || confirmados + em_voo >= n) continue;
+            msg m = { .type = CLIENT_KV, .value = chave, .origin = KV_PUT, .num = chave * 2 };
+            if (send_frame(conns[i], &m) < 0) continue;
+            chave++;
+            em_voo++;
+        }
+    }
+    gettimeofday(&t1, NULL);
+    long ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_usec - t0.tv_usec) / 1000;
+    printf("[client] carga: %d PUTs confirmados em %ld ms (%.0f comandos/s), %d recusados, %d sem resposta, janela %d\n",
+           confirmados, ms, confirmados * 1000.0 / (ms > 0 ? ms : 1), recusados, perdidos, janela);
+    for (int i = 0; i < CARGA_CONEXOES; i++) if (conns[i] >= 0) close(conns[i]);
+    close(ack_srv);
+    return 0;
+}
+
 // funcao principal do cliente
 // descobre o lider, envia propostas de valores para o node lider
 // aguarda confirmacao de consenso para cada valor
-int main() {
+int main(int argc, char **argv) {
+    if (argc >= 2 && strcmp(argv[1], "kv") == 0) return kv_main(argc >= 3 ? atoi(argv[2]) : 0, argc >= 4 ? atoi(argv[3]) : 1);
+    if (argc >= 2 && strcmp(argv[1], "carga") == 0)
+        return carga_main(argc >= 3 ? atoi(argv[2]) : 20000, argc >= 4 ? atoi(argv[3]) : CARGA_JANELA, argc >= 5 ? atoi(argv[4]) : 1);
+
     int leader_id = receive_leader(); // descobre quem e o lider
 
     char ts[32], buf[128];
@@ -120,9 +461,26 @@ int main() {
                 .sin_port = htons(port),
                 .sin_addr.s_addr = inet_addr("127.0.0.1") };
             if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
-                msg m = { CLIENT_PROPOSE, val };
-                write(sock, &m, sizeof(m));
-                printf("[client] valor enviado %d ao lider %d\n", val, leader_id);
+                msg m = { .type = CLIENT_PROPOSE, .value = val };
+                send_frame(sock, &m);
+                // o lider so responde nesta conexao se recusar (fila de propostas cheia)
+                shutdown(sock, SHUT_WR);
+                msg resp;
+                int respondeu = read_frame(sock, &resp) == 0;
+                if (respondeu && resp.type == CLIENT_LEADER) {
+                    // o valor e de um grupo com outro lider, reenvia para ele
+                    printf("[client] valor %d e do grupo liderado pelo node %d, reenviando\n", val, resp.value);
+                    port = BASE_PORT + 100 + resp.value;
+                    close(sock);
+                    continue;
+                }
+                if (respondeu && resp.type == CLIENT_BUSY) {
+                    printf("[client] lider %d ocupado, reenviando %d\n", leader_id, val);
+                    close(sock);
+                    sleep(1);
+                    continue;
+                }
+                printf("[client] valor enviado %d ao node %d\n", val, port - BASE_PORT - 100);
 
                 char ts[32], buf[128];
                 timestamp(ts, sizeof(ts));
@@ -154,13 +512,17 @@ int main() {
                 int c2 = accept(ack_srv, NULL, NULL);
                 if (c2 >= 0) {
                     msg r;
-                    if (read(c2, &r, sizeof(r)) == sizeof(r) && r.type == CLIENT_OK) {
+                    if (read_frame(c2, &r) == 0 && r.type == CLIENT_OK) {
                         printf("[client] recebido ok para %d\n", r.value);
                         char ts[32], buf[128];
                         timestamp(ts, sizeof(ts));
                         snprintf(buf, sizeof(buf), "%s,client,%d,RECV_OK,,%d\n", ts, leader_id, r.value);
                         send_monitor(buf);
                         enviado = 1;
+                        // valor decidido ja pode ser lido do lider
+                        int lido;
+                        if (lease_read(leader_id, val, &lido) == 0) printf("[client] leitura do lider %d: %d\n", leader_id, lido);
+                        else printf("[client] leitura recusada pelo lider %d\n", leader_id);
                     } else {
                         fprintf(stderr, "[client] ack invalido\n");
                     }
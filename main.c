@@ -3,6 +3,8 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <sys/mman.h>
+#include <glob.h>
 
 int main() {
     printf("Compilando client.c, monitor.c e node1-5.c...\n");
@@ -38,6 +40,20 @@ int main() {
     // da um tempo para o monitor subir
     sleep(1);
 
+    shm_unlink("/paxos_shm"); // descarta aneis de uma execucao anterior do transporte shm
+    // o cluster comeca do zero: WAL, log decidido e snapshots de uma execucao anterior fariam os nodes lembrarem de outro log
+    // depois da compactacao os segmentos e as geracoes do WAL nao comecam mais do zero, entao vai por padrao de nome
+    char *wal_dir = getenv("PAXOS_WAL_DIR");
+    const char *restos[] = {"paxos_wal_*.log", "paxos_log_*.seg", "paxos_snap_*"};
+    for (int i = 0; i < 3; i++) {
+        char pattern[256];
+        snprintf(pattern, sizeof(pattern), "%s/%s", wal_dir ? wal_dir : ".", restos[i]);
+        glob_t gl;
+        if (glob(pattern, 0, NULL, &gl) != 0) continue;
+        for (size_t f = 0; f < gl.gl_pathc; f++) unlink(gl.gl_pathv[f]);
+        globfree(&gl);
+    }
+
     int fail_case = 0;
     char *env = getenv("PAXOS_FAIL_CASE");
     if (env) fail_case = atoi(env);
@@ -87,6 +103,8 @@ int main() {
     }
     waitpid(mon_pid, NULL, 0);
 
+    shm_unlink("/paxos_shm"); // segmento do transporte shm, se foi usado
+
     system("./limpar.sh");
     printf("Simulação finalizada. events.csv disponível.\n");
     return 0;
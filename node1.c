@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4, sendmmsg/recvmmsg
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,20 @@
 #include <sys/time.h>
 #include <time.h>
 #include <stdint.h> 
+#include <errno.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/io_uring.h>
+#include <glob.h>
 
 #define BASE_PORT       5000
 #define MONITOR_PORT    6000
@@ -16,18 +31,80 @@
 #define CLIENT_ACK_PORT (CLIENT_PORT + 1)
 #define NODES           5
 #define QUEUE_CAPACITY  128
+#define PROPOSAL_WAIT_MS 500    // quanto uma conexao do cliente espera vaga na fila de propostas antes de recusar
 #define ELECTION_TIMEOUT 3      // segundos para coletar candidaturas
 #define TIMEOUT_SEC     5       // intervalo Paxos
 #define KNOWN_STATES    5
+#define HEARTBEAT_MS    1000    // enlace do lider parado ha mais que isso recebe heartbeat explicito
+#define MAX_EVENTS      64      // eventos tratados por chamada do epoll_wait
+#define WIRE_VERSION    3       // versao do formato de quadro, primeiro byte de todo quadro
+#define FRAME_HDR_MAX   6       // versao (1 byte) + tamanho do conteudo (varint, ate 5 bytes)
+#define MAX_FRAME       1024    // maior conteudo de quadro aceito, acima disso a conexao e descartada
+#define MSG_FIELDS      6       // campos de uma mensagem no fio, cada um um varint
+#define MSG_WIRE_MAX    (MSG_FIELDS * 5)
+#define MAX_BATCH       32      // mensagens por envelope (cabe em MAX_FRAME)
+#define FRAME_MAX_BYTES (FRAME_HDR_MAX + 5 + MAX_BATCH * MSG_WIRE_MAX)
+#define CONN_BUF_SIZE   4096    // buffer de remontagem por conexao
+#define SEND_DEADLINE_MS 200    // prazo por vizinho para conectar e escrever um quadro no fan-out
+#define OUTQ_CAPACITY   256     // mensagens na fila de saida de cada vizinho
+#define RECONNECT_MS    100     // espera antes de tentar de novo um vizinho que falhou
+#define BREAKER_FAILS   3       // falhas seguidas que abrem o disjuntor de um destino
+#define BACKOFF_MAX_MS  1000    // maior espera entre sondagens de um destino fora do ar
+#define PEER_SILENT_MS  (3 * HEARTBEAT_MS) // udp: envios sem nada recebido do vizinho ha mais que isso contam como falha
+#define CLIENT_DEADLINE_MS 2000 // prazo total para alcancar o cliente
+#define INFORM_TRIES    30      // tentativas (uma por segundo alem do prazo) de avisar o cliente do lider eleito
+#define MAX_DGRAM       1400    // maior datagrama do transporte udp (cabe num quadro ethernet e num envelope cheio)
+#define RETRANSMIT_MS   300     // reenvia PREPARE/ACCEPT sem resposta (e ELECTION no udp)
+#define SHM_NAME        "/paxos_shm"    // segmento compartilhado do transporte shm
+#define SHM_RING_SLOTS  256     // mensagens por anel (potencia de 2)
+#define URING_ENTRIES   256     // tamanho dos aneis de submissao do io_uring
+#define URING_BUFS      64      // buffers fornecidos ao kernel para o recv multishot
+#define URING_BUF_SIZE  2048
+#define URING_BGID      1       // grupo dos buffers fornecidos
+#define LOG_CAPACITY    1024    // instancias do log replicado guardadas em memoria (anel por instancia)
+#define DEFAULT_WINDOW  8       // instancias em voo no lider, PAXOS_WINDOW muda
+#define INFLIGHT_MSGS   (QUEUE_CAPACITY / 2) // mensagens dos lotes em voo que o lider deixa na fila de cada seguidor
+#define PROMISE_PAGE    (QUEUE_CAPACITY / 2 / (NODES - 1)) // fase 1: mensagens por pagina de resposta ao PREPARE, de todos os acceptors cabe na fila do lider
+#define ENTRY_MAX_VALUES 16     // valores do cliente num lote (uma instancia do log), PAXOS_BATCH limita
+#define MAX_GROUPS      8       // grupos paxos independentes por node, PAXOS_GROUPS escolhe quantos
+#define THRIFTY_MIN_MS  20      // menor espera antes de mandar o lote aos vizinhos fora da maioria mais rapida
+#define THRIFTY_PROBE_MS 1000   // a cada intervalo o rtt de quem ficou de fora cai pela metade e ele volta a ser testado
+#define LEASE_MS        2000    // validade do lease do lider, abaixo da deteccao de falha do leader_monitor
+#define LEASE_DRIFT_MS  100     // margem que o lider desconta do lease pela diferenca entre relogios
+#define MENCIUS_BALLOT  1       // modo mencius: proposta do dono nas suas instancias, sem fase 1
+#define REVOKE_MS       (3 * HEARTBEAT_MS) // modo mencius: dono calado ha mais que isso, com a fronteira parada nele, e revogado
+#define WAL_BUF_SIZE    (1 << 20) // registros do WAL esperando a proxima escrita
+#define HELD_MAX        256     // respostas do acceptor esperando o WAL, por grupo
+#define SEG_SLOTS       65536   // instancias por segmento do log decidido em disco
+#define SEG_MAX         256     // segmentos mapeados por grupo, ate SEG_SLOTS * SEG_MAX instancias depois do snapshot
+#define SEG_INDEX_BYTES (SEG_SLOTS * sizeof(uint32_t))
+#define SEG_BYTES       (SEG_INDEX_BYTES + SEG_SLOTS * sizeof(int32_t) * (2 + ENTRY_MAX_VALUES))
+#define SNAPSHOT_EVERY  10000   // instancias aplicadas entre snapshots, PAXOS_SNAPSHOT_EVERY muda (0 = sem snapshot)
+#define SNAPSHOT_CHECK_MS 1000  // intervalo em que a thread snapshotter olha os grupos
+#define SNAPSHOT_FORCE  (SEG_SLOTS * (SEG_MAX - 2)) // instancias sem snapshot que forcam um, mesmo com PAXOS_SNAPSHOT_EVERY=0
+#define CATCHUP_WAIT_MS 500     // buraco no log que dura mais que isso vira pedido de catch-up
+#define CATCHUP_RETRY_MS 1000   // pedido de catch-up sem resposta e refeito depois disso
+#define LEAD_CATCHUP_MS 5000    // lider atrasado demais espera o catch-up ate isso antes de refazer a fase 1
+#define CATCHUP_CHUNK_MSGS (QUEUE_CAPACITY / 2) // mensagens por pedaco: cabe na fila do grupo do node atrasado com o trafego normal
+#define CATCHUP_RATE    20000   // instancias por segundo que um node manda em catch-up, PAXOS_CATCHUP_RATE muda
+#define KV_INITIAL_CAP  1024    // posicoes iniciais do mapa chave-valor de cada grupo (potencia de 2)
 
 
-enum msg_type { ELECTION, COORDINATOR, PREPARE, PROMISE, ACCEPT, ACCEPTED, HEARTBEAT };
+// os valores sao os codigos usados no fio, nao reordenar
+enum msg_type { ELECTION = 0, COORDINATOR = 1, PREPARE = 2, PROMISE = 3, ACCEPT = 4, ACCEPTED = 5, HEARTBEAT = 6,
+                ACCEPT_VALUE = 7, PROMISE_VALUE = 8, DECIDED = 9, LEASE_ACK = 10, SKIP = 11,
+                CATCHUP_REQ = 12, CATCHUP_VALUE = 13, CATCHUP_ENTRY = 14, CATCHUP_SNAP = 15, CATCHUP_END = 16,
+                CATCHUP_DATA = 17, PROMISE_MORE = 18, NACK = 19,
+                CLIENT_PROPOSE = 1000, CLIENT_OK = 1001, CLIENT_LEADER = 1002, CLIENT_BUSY = 1003,
+                CLIENT_READ = 1004, CLIENT_VALUE = 1005, CLIENT_KV = 1006, CLIENT_RESULT = 1007 };
 
 typedef struct msg {
     enum msg_type type;
     int from_id;
     int proposal_num;
     int proposal_val;   
+    int slot;           // instancia do consenso (multi-paxos), uma por lote decidido
+    int group;          // grupo paxos da mensagem (eleicao e cliente usam o grupo 0)
 } msg;
 
 
@@ -37,382 +114,3970 @@ typedef struct msg_queue {
     int head, tail, size;
     pthread_mutex_t mtx;
     pthread_cond_t cond;
+    pthread_cond_t space;   // alguma mensagem saiu, quem espera vaga pode tentar de novo
 } msg_queue;
 
-static msg_queue inbox;
+// uma instancia do log replicado: um lote de valores do cliente (lote vazio = instancia sem valor)
+// a mesma entrada guarda o estado de acceptor e, no lider, a contagem de ACCEPTED
+// no fio o lote vai como um ACCEPT_VALUE por valor seguido de um ACCEPT com a quantidade
+typedef struct log_entry {
+    int slot;           // instancia guardada nesta posicao do anel (0 = vazia)
+    int ballot;         // proposta com que o lote foi aceito
+    int nvals;
+    int vals[ENTRY_MAX_VALUES];
+    int stage_ballot;   // lote chegando em ACCEPT_VALUE/PROMISE_VALUE, ainda sem o fechamento
+    unsigned stage_mask; // posicoes do lote ja recebidas
+    int stage_vals[ENTRY_MAX_VALUES];
+    int committed;      // quorum da fase 2 aceitou, falta so aplicar em ordem
+    int acks;           // so no lider: ACCEPTED recebidos, contando o proprio lider
+    unsigned char acked[NODES + 1];
+    long sent_ms;       // so no lider: ultimo envio do ACCEPT, para o reenvio udp
+    unsigned char sent_to[NODES + 1]; // so no lider: vizinhos que ja receberam o lote
+    long sent_us[NODES + 1];          // quando cada um recebeu, para medir o rtt
+    long fallback_ms;   // so no modo thrifty: sem maioria ate aqui o lote vai para os demais (0 = ja foi)
+    int mine;           // este node propos o lote: conta os ACCEPTED e responde ao cliente
+} log_entry;
+
+// instancia decidida guardada num segmento, lida direto do mapeamento (sem copia)
+typedef struct store_entry {
+    int32_t slot;
+    int32_t nvals;
+    int32_t vals[];
+} store_entry;
+
+// segmento do log decidido: arquivo de tamanho fixo mapeado inteiro, com o indice instancia -> deslocamento
+// (0 = ausente) no comeco e depois as entradas, gravadas em ordem de instancia
+typedef struct log_segment {
+    char *base;         // NULL = segmento ainda nao aberto
+    uint32_t used;      // fim da ultima entrada gravada
+    int last;           // maior instancia gravada
+} log_segment;
+
+// operacoes da maquina chave-valor, primeiro inteiro do comando no log
+enum kv_op { KV_GET = 1, KV_PUT = 2, KV_DELETE = 3, KV_CAS = 4 };
+// estado de uma posicao do mapa chave-valor
+enum kv_slot { KV_EMPTY = 0, KV_FULL, KV_DELETED };
+
+// mapa chave-valor de enderecamento aberto com sondagem linear, sem alocacao por chave
+// a remocao deixa a marca KV_DELETED para nao cortar a sondagem; o crescimento refaz o mapa sem as marcas
+typedef struct kv_map {
+    int32_t *keys;
+    int32_t *vals;
+    unsigned char *state;   // enum kv_slot de cada posicao
+    uint32_t cap;           // potencia de 2 (0 = ainda nao alocado)
+    uint32_t count;         // chaves presentes
+    uint32_t used;          // posicoes ocupadas, contando as marcas de remocao
+} kv_map;
+
+// resultado de um comando aplicado, devolvido ao cliente
+enum sm_status { SM_OK = 0, SM_NOT_FOUND = 1, SM_CAS_FAILED = 2 };
+typedef struct sm_result {
+    int status;
+    int value;          // valor da chave antes do comando (registrador: valor anterior)
+} sm_result;
+
+// um grupo paxos: log, lider, lease e thread paxos proprios, dono das chaves com valor % ngroups == id
+// transporte, heartbeat, eleicao e monitor sao do node e servem todos os grupos
+typedef struct paxos_group {
+    int id;
+    log_entry rlog[LOG_CAPACITY];
+    msg_queue inbox;            // mensagens do grupo (o grupo 0 tambem recebe as da eleicao)
+    msg_queue proposals;        // propostas do cliente esperando instancia
+    int highest_proposal;
+    int promised_num;           // maior proposta prometida por este acceptor
+    _Atomic int leader_ballot;  // proposta da fase 1 do mandato atual (0 = lider ainda precisa preparar), vai na rodada de lease
+    int next_slot;              // proxima instancia que o lider vai propor
+    int last_slot;              // maior instancia aceita por este acceptor
+    int commit_index;           // ultima instancia decidida e aplicada em ordem
+    int decided_sent;           // ultimo commit_index avisado aos seguidores pelo lider
+    int lead_after;             // lider atrasado: so refaz a fase 1 com commit_index ate aqui (ou passado LEAD_CATCHUP_MS)
+    long lead_wait_ms;
+    // fase 1 (mandato ou revogacao mencius), por acceptor e instancia: maior proposta aceita que ele mandou
+    // (+ 1, 0 = nada) e se o lote dela chegou inteiro
+    int promise_seen[NODES + 1][LOG_CAPACITY];
+    unsigned char promise_full[NODES + 1][LOG_CAPACITY];
+    // modo mencius: promessa do acceptor por dono, so vale na faixa revogada de instancias dele
+    int owner_promise[NODES + 1];
+    int owner_from[NODES + 1], owner_to[NODES + 1];
+    // modo mencius: revogacao feita por este node (revoke_ballot 0 = nenhuma em andamento)
+    int revoke_ballot, revoke_from, revoke_to, revoke_promises;
+    unsigned char revoke_promised[NODES + 1];
+    long revoke_ms;
+    int frontier_slot;          // modo mencius: commit_index da ultima vez que a fronteira andou
+    long frontier_ms;
+    long wal_lsn;               // fim do ultimo registro do WAL feito por este grupo
+    msg held[HELD_MAX];         // respostas do acceptor que so saem com o registro delas gravado
+    int held_to[HELD_MAX];      // destino de cada uma (0 = todos)
+    int nheld;
+    // log decidido em disco: o anel rlog so guarda a janela em voo, o historico fica nos segmentos
+    log_segment segs[SEG_MAX];  // circular: o segmento seg fica em segs[seg % SEG_MAX]
+    int seg_first;              // primeiro segmento ainda no disco, os anteriores foram compactados
+    _Atomic int snap_index;     // ultima instancia coberta pelo snapshot gravado
+    pthread_mutex_t store_mtx;  // compactacao contra a leitura dos segmentos pelo catch-up e troca do snapshot
+    _Atomic int wal_checkpoint; // rotacao do WAL pediu que o grupo regrave o estado do acceptor no arquivo novo
+    _Atomic long checkpoint_lsn; // fim do ultimo checkpoint do grupo no WAL
+    int checkpoint_applied;     // ultima instancia aplicada quando o checkpoint foi feito
+    // catch-up do node atrasado: quem mostrou estar mais adiante e ate onde, visto pelo listener
+    _Atomic int catchup_upto, catchup_peer;
+    long gap_ms;                // desde quando o log tem um buraco ate gap_upto (0 = sem buraco)
+    int gap_upto;
+    long catchup_ms;            // ultimo pedido de catch-up
+    int catchup_base;           // commit_index quando o pedido saiu
+    long catchup_start_ms;      // inicio do catch-up em andamento (0 = nenhum)
+    int catchup_count;          // instancias recebidas pelo catch-up em andamento
+    int catchup_slot, catchup_got; // lote sendo recebido
+    int catchup_vals[ENTRY_MAX_VALUES];
+    int catchup_snap_base;      // palavras do snapshot ja recebidas quando o pedido saiu
+    int32_t *snap_rx;           // snapshot chegando pelo catch-up, palavra por palavra
+    int snap_rx_index, snap_rx_words, snap_rx_got; // snap_rx_index 0 = nenhum
+    uint32_t snap_rx_sum;
+    long peer_rtt_us[NODES + 1]; // rtt medio do ACCEPT ate o ACCEPTED de cada vizinho (media movel)
+    long rtt_decay_ms;          // ultima reducao do rtt dos vizinhos fora do quorum mais rapido
+    pthread_mutex_t state_mtx;  // estado aplicado, lido pelas conexoes do cliente
+    int applied_value;          // ultimo valor aplicado (o registrador replicado do grupo)
+    kv_map kv;                  // maquina chave-valor do grupo (PAXOS_SM=kv)
+    int applied_index;          // ultima instancia aplicada (lote vazio nao muda o valor)
+    long applied_cmds;          // comandos aplicados desde a partida, para a vazao
+    _Atomic int read_barrier;   // lider so le depois de aplicar ate aqui (log herdado do mandato anterior)
+    // lease do lider do grupo: renovado pelos heartbeats, enquanto vale nenhum seguidor que confirmou aceita outro lider
+    pthread_mutex_t lease_mtx;
+    int lease_round;            // lider: rodada de renovacao (numero no HEARTBEAT e no LEASE_ACK)
+    long lease_round_ms;        // lider: quando a rodada saiu, o lease conta a partir daqui
+    int lease_acks;
+    unsigned char lease_acked[NODES + 1];
+    long lease_until;           // lider: ate quando responde leitura sem rodada de paxos
+    int lease_holder;           // seguidor: node a quem concedeu o lease
+    long lease_granted_until;   // seguidor: ate quando nao aceita PREPARE de outro node
+} paxos_group;
+
+// maquina de estados replicada: as instancias decididas sao aplicadas nela em ordem, comando por comando
+// cada comando ocupa cmd_len inteiros de um lote; PAXOS_SM escolhe a maquina na partida
+typedef struct state_machine {
+    const char *name;
+    int cmd_len;
+    enum msg_type request;      // pedido do cliente que vira comando no log
+    int (*encode)(const msg *m, int *cmd);     // pedido -> comando, 0 se invalido
+    int (*valid)(const int *cmd);              // acceptor confere o comando antes de aceitar
+    // as funcoes abaixo que recebem o grupo rodam com state_mtx
+    void (*apply)(paxos_group *g, const int *cmd, sm_result *res);
+    void (*read)(paxos_group *g, int key, sm_result *res);     // leitura pelo lease
+    int32_t *(*save)(paxos_group *g, int *nwords);             // copia do estado para o snapshot (malloc)
+    void (*load)(paxos_group *g, const int32_t *words, int nwords);
+    void (*reply)(int node_id, const int *cmd, const sm_result *res); // quem propos responde ao cliente
+    void (*learned)(int node_id, const int *cmd, int slot);           // comando proposto por outro node
+} state_machine;
+
+static paxos_group grp[MAX_GROUPS];
+static int ngroups = 1;             // grupos ativos, PAXOS_GROUPS
 static int election_done = 0;
 static int leader_id = -1;
-static int highest_proposal = 0;
-static int promise_count = 0;
-static int accepted_count = 0;
-static int accepted_value = -1;
-static int proposal_value = -1; 
+static int window = DEFAULT_WINDOW; // instancias em voo permitidas no lider
+static int batch_max = ENTRY_MAX_VALUES; // comandos por lote, PAXOS_BATCH (limitado pelos inteiros de uma instancia)
+static int batch_ms = 0;            // quanto o lider espera para encher um lote, PAXOS_BATCH_MS
+static int q1 = NODES/2 + 1;        // quorum da fase 1 (PAXOS_Q1), contando o lider
+static int q2 = NODES/2 + 1;        // quorum da fase 2 (PAXOS_Q2); q1 + q2 > NODES garante a intersecao
+static int thrifty = 0;             // PAXOS_THRIFTY: fase 2 so para o quorum mais rapido
+static int mencius = 0;             // PAXOS_MENCIUS: instancias giram entre os nodes, cada um propoe nas suas
+
+static int known_states[KNOWN_STATES] = {42, 99, 7, 1234, 56}; 
+
+static int fail_case = 0; // 0 = normal, 2 = lider cai depois da 1a proposta, 3 = node cai
+static int leader_alive = 1; // flag para indicar se o lider esta vivo
+static time_t last_heartbeat = 0; // timestamp do ultimo heartbeat 
+static _Atomic long last_sent_ms[NODES + 1]; // ultimo envio para cada vizinho (qualquer mensagem)
+static _Atomic long last_recv_ms[NODES + 1]; // ultima mensagem recebida de cada vizinho
+
+// saude de um destino vista pelo disjuntor
+enum peer_health { PEER_UP, PEER_DOWN, PEER_PROBING };
+
+// disjuntor por destino: depois de BREAKER_FAILS falhas seguidas para de tentar
+// e so sonda de novo com espera exponencial ate BACKOFF_MAX_MS
+typedef struct breaker {
+    int state;              // enum peer_health
+    int fails;              // falhas seguidas
+    long backoff_ms;        // espera ate a proxima sondagem com o disjuntor aberto
+    long retry_at_ms;       // nao tenta antes disso
+} breaker;
+
+// estado de envio para um node vizinho: fila de saida limitada e conexao tcp persistente
+// as threads do protocolo so enfileiram; a thread peer_io esvazia as filas pelo transporte
+typedef struct peer_conn {
+    int fd;                 // socket conectado ou -1 se ainda nao conectou (so a peer_io mexe)
+    unsigned gen;           // geracao do socket, distingue conclusoes de sockets antigos no io_uring
+    int watching;           // io_uring ja vigia o fechamento deste socket
+    msg outq[OUTQ_CAPACITY];
+    int head, size;
+    unsigned long first_seq; // numero de sequencia da mensagem em outq[head]
+    int congested;          // passou da marca alta e ainda nao desceu ate a baixa
+    long dropped;           // mensagens antigas descartadas com a fila cheia
+    breaker br;             // saude do vizinho, so a peer_io muda
+} peer_conn;
+
+static peer_conn peers[NODES + 1];
+static pthread_mutex_t outq_mtx = PTHREAD_MUTEX_INITIALIZER;   // protege as filas de saida
+static pthread_cond_t outq_cond = PTHREAD_COND_INITIALIZER;    // mensagem nova para a peer_io
+static pthread_cond_t outq_space = PTHREAD_COND_INITIALIZER;   // alguma fila saiu do congestionamento
+static int outq_high = OUTQ_CAPACITY * 3 / 4; // marcas configuraveis por PAXOS_OUTQ_HIGH / PAXOS_OUTQ_LOW
+static int outq_low = OUTQ_CAPACITY / 4;
+
+// resultado de colocar uma mensagem nas filas de saida (o pior entre os destinos)
+enum send_status { SEND_OK, SEND_CONGESTED, SEND_DROPPED };
+
+// lote que a peer_io tira da fila de um vizinho e entrega ao transporte
+typedef struct out_batch {
+    int target_id;
+    int n;                      // mensagens no lote
+    int sent;                   // quantas o transporte entregou
+    int backpressure;           // destino vivo mas sem espaco (anel shm cheio): nao conta como falha
+    unsigned long first_seq;    // sequencia da primeira mensagem do lote
+    msg ms[MAX_BATCH];
+    char frame[FRAME_MAX_BYTES];
+    size_t flen;
+} out_batch;
+
+// transporte entre nodes, escolhido na partida pela variavel PAXOS_TRANSPORT (tcp, udp, shm ou uring)
+enum transport_kind { TRANSPORT_TCP, TRANSPORT_UDP, TRANSPORT_SHM, TRANSPORT_URING };
+static int transport = TRANSPORT_TCP;
+static const char *transport_names[] = { "tcp", "udp", "shm", "uring" };
+static atomic_long msgs_sent, msgs_recv; // mensagens entre nodes, para o relatorio de PAXOS_STATS_MS
+
+static int udp_sock = -1;
+
+// anel de um produtor e um consumidor em memoria compartilhada (node origem -> node destino)
+// head so e escrito pelo consumidor e tail so pelo produtor, cada um na sua linha de cache
+typedef struct shm_ring {
+    _Atomic uint32_t head;
+    char pad1[60];
+    _Atomic uint32_t tail;
+    char pad2[60];
+    msg slots[SHM_RING_SLOTS];
+} shm_ring;
+
+// segmento compartilhado por todos os nodes da mesma maquina
+typedef struct shm_area {
+    shm_ring rings[NODES + 1][NODES + 1];   // rings[origem][destino]
+    _Atomic uint32_t doorbell[NODES + 1];   // contador do destino, usado no futex
+    _Atomic uint32_t waiting[NODES + 1];    // destino dormindo no futex
+} shm_area;
+
+static shm_area *shm = NULL;
+
+// anel do io_uring mapeado na memoria do processo (acesso direto, sem liburing)
+typedef struct uring {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_local_tail;     // sqes preenchidas e ainda nao publicadas para o kernel
+    unsigned to_submit;
+} uring;
+
+// tipos de operacao no user_data do anel de envio (o alvo vai nos 8 bits de baixo, a geracao acima)
+enum uring_op { UR_CONNECT = 1, UR_SEND, UR_TIMEOUT, UR_WATCH, UR_CANCEL };
+#define UR_ACCEPT   1           // user_data do accept multishot no anel de recepcao
+#define UR_PROVIDE  2           // user_data da devolucao de buffers (conexoes usam o ponteiro do conn_state)
+
+static uring rx_ring, tx_ring;
+static char rx_bufs[URING_BUFS][URING_BUF_SIZE];
+static char tx_bufs[NODES + 1][FRAME_MAX_BYTES]; // registrados no kernel, um por vizinho
+static size_t tx_len[NODES + 1];
+static struct sockaddr_in peer_addrs[NODES + 1];
+
+// envio em andamento para um vizinho durante o fan-out
+typedef struct pending_send {
+    out_batch *b;
+    int connecting;             // connect nao bloqueante ainda em andamento
+    int retried;                // ja reabriu a conexao uma vez neste envio
+    size_t sent;                // bytes do quadro ja escritos
+} pending_send;
+
+// estado de leitura de uma conexao aceita pelo listener
+typedef struct conn_state {
+    int fd;
+    size_t len;                 // bytes pendentes em buf (quadro incompleto)
+    int dead;                   // io_uring: fluxo corrompido, so espera a ultima conclusao do recv para sair
+    char buf[CONN_BUF_SIZE];
+} conn_state;
+
+// politica de gravacao do WAL do acceptor, PAXOS_WAL_SYNC
+enum wal_sync { WAL_OFF, WAL_WRITE, WAL_FSYNC };
+// tipos de registro do WAL
+enum wal_rec { WAL_PROMISE = 1, WAL_ACCEPT = 2, WAL_OWNER = 3 };
+
+// registro do WAL: cabecalho fixo seguido dos valores do lote (so WAL_ACCEPT)
+// o checksum acha o fim valido do arquivo depois de uma queda no meio de uma escrita
+typedef struct wal_header {
+    uint32_t sum;       // fnv-1a do resto do registro
+    int32_t type;
+    int32_t group;
+    int32_t ballot;
+    int32_t slot;       // WAL_OWNER: primeira instancia revogada
+    int32_t n;          // WAL_ACCEPT: valores do lote; WAL_OWNER: ultima instancia revogada
+} wal_header;
+
+// WAL do node, um arquivo para todos os grupos: quem grava so acrescenta no buffer e a thread
+// wal_flusher escreve tudo o que se juntou enquanto isso com um unico fsync (group commit)
+typedef struct wal_log {
+    int fd;
+    pthread_mutex_t mtx;
+    pthread_cond_t flush;       // alguem espera durabilidade
+    pthread_cond_t durable;     // durable_lsn andou
+    int want;
+    char *buf;                  // registros ainda nao escritos
+    size_t len;
+    long appended_lsn;          // bytes ja acrescentados nesta execucao
+    long durable_lsn;           // bytes ja escritos (e sincronizados, conforme a politica)
+    // rotacao: o WAL e uma sequencia de arquivos (geracoes); o snapshot permite apagar as antigas
+    int gen;                    // geracao sendo escrita
+    int oldest_gen;             // geracao mais antiga ainda no disco
+    int next_fd;                // arquivo da proxima geracao, aberto e esperando o ponto de troca (-1 = nenhum)
+    long rotate_lsn;            // registros a partir daqui vao para a proxima geracao
+} wal_log;
+
+static wal_log wal = { .fd = -1, .next_fd = -1, .mtx = PTHREAD_MUTEX_INITIALIZER, .flush = PTHREAD_COND_INITIALIZER,
+                       .durable = PTHREAD_COND_INITIALIZER };
+static int wal_sync = WAL_FSYNC;
+static int snapshot_every = SNAPSHOT_EVERY;
+static int catchup_rate = CATCHUP_RATE;
+static msg_queue catchup_q;         // pedidos de catch-up, atendidos fora das threads paxos
+static msg_queue late_q;            // candidaturas de nodes que voltaram depois da eleicao
+static msg_queue election_q;        // candidaturas e COORDINATOR durante a eleicao, so a thread election le
+static msg_queue reply_q;           // respostas ao cliente, enviadas pela thread client_replier
+static int stats_ms = 0;            // intervalo do relatorio de vazao, PAXOS_STATS_MS (0 = sem relatorio)
+
+// snapshot do estado aplicado de um grupo, gravado inteiro num arquivo por grupo:
+// cabecalho seguido das palavras que a maquina de estados tirou do estado
+typedef struct snapshot_header {
+    uint32_t sum;       // fnv-1a do resto do cabecalho e das palavras
+    int32_t group;
+    int32_t index;      // ultima instancia coberta
+    int32_t nwords;     // palavras do estado depois do cabecalho
+} snapshot_header;
+
+// inicializa a fila de mensagens 
+void queue_init(msg_queue *q) {
+    q->head = q->tail = q->size = 0;
+    pthread_mutex_init(&q->mtx, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    pthread_cond_init(&q->space, NULL);
+}
+
+// adiciona uma mensagem a fila de mensagens
+void enqueue(msg_queue *q, msg *m) {
+    pthread_mutex_lock(&q->mtx);
+    if (q->size < QUEUE_CAPACITY) {
+        q->data[q->tail++] = *m;
+        if (q->tail >= QUEUE_CAPACITY) q->tail = 0;
+        q->size++;
+        pthread_cond_signal(&q->cond); // sinaliza que tem mensagem nova
+    }
+    pthread_mutex_unlock(&q->mtx);
+}
+
+// adiciona uma mensagem esperando no maximo timeout_ms por vaga, retorna 0 se a fila continuou cheia
+// nao perde mensagem: quem chama decide o que fazer com a recusa
+int enqueue_wait(msg_queue *q, msg *m, int timeout_ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&q->mtx);
+    while (q->size >= QUEUE_CAPACITY) {
+        if (pthread_cond_timedwait(&q->space, &q->mtx, &until) == ETIMEDOUT) {
+            pthread_mutex_unlock(&q->mtx);
+            return 0;
+        }
+    }
+    q->data[q->tail++] = *m;
+    if (q->tail >= QUEUE_CAPACITY) q->tail = 0;
+    q->size++;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mtx);
+    return 1;
+}
+
+// adiciona varias mensagens de uma vez, pegando o lock uma unica vez
+void enqueue_many(msg_queue *q, msg *ms, int n) {
+    pthread_mutex_lock(&q->mtx);
+    for (int i = 0; i < n && q->size < QUEUE_CAPACITY; i++) {
+        q->data[q->tail++] = ms[i];
+        if (q->tail >= QUEUE_CAPACITY) q->tail = 0;
+        q->size++;
+    }
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->mtx);
+}
+
+// remove uma mensagem da fila esperando no maximo timeout_ms, retorna 0 se o tempo acabou
+int dequeue_timeout(msg_queue *q, msg *m, int timeout_ms) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&q->mtx);
+    while (q->size == 0) {
+        if (pthread_cond_timedwait(&q->cond, &q->mtx, &until) == ETIMEDOUT) {
+            pthread_mutex_unlock(&q->mtx);
+            return 0;
+        }
+    }
+    *m = q->data[q->head++];
+    if (q->head >= QUEUE_CAPACITY) q->head = 0;
+    q->size--;
+    pthread_cond_signal(&q->space);
+    pthread_mutex_unlock(&q->mtx);
+    return 1;
+}
+
+// remove uma mensagem da fila de mensagens 
+int dequeue(msg_queue *q, msg *m) {
+    pthread_mutex_lock(&q->mtx);
+    while (q->size == 0) pthread_cond_wait(&q->cond, &q->mtx); // espera mensagem
+    *m = q->data[q->head++];
+    if (q->head >= QUEUE_CAPACITY) q->head = 0;
+    q->size--;
+    pthread_cond_signal(&q->space);
+    pthread_mutex_unlock(&q->mtx);
+    return 1;
+}
+
+// inicializa o pool de conexoes com os outros nodes
+void peers_init(void) {
+    for (int i = 0; i <= NODES; i++) {
+        peers[i].fd = -1;
+    }
+}
+
+// inicia um connect nao bloqueante numa porta local
+// retorna o socket (connecting indica se ainda esta em andamento) ou -1 se a porta recusou
+int tcp_connect_start(int port, int *connecting) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = inet_addr("127.0.0.1") };
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // mensagens pequenas, sem nagle
+    *connecting = 0;
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) return sock;
+    if (errno == EINPROGRESS) {
+        *connecting = 1;
+        return sock;
+    }
+    close(sock);
+    return -1;
+}
+
+// inicia um connect nao bloqueante com o node target_id
+int peer_connect_start(int target_id, int *connecting) {
+    return tcp_connect_start(BASE_PORT + target_id, connecting);
+}
+
+// tempo monotonico em milissegundos
+long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// tempo monotonico em microssegundos, para o rtt entre nodes locais
+long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// connect com prazo: retorna o socket ja conectado e em modo bloqueante, ou -1
+int connect_deadline(int port, long timeout_ms) {
+    int connecting;
+    int sock = tcp_connect_start(port, &connecting);
+    if (sock < 0) return -1;
+    if (connecting) {
+        struct pollfd pfd = { sock, POLLOUT, 0 };
+        int err = 0;
+        socklen_t elen = sizeof(err);
+        if (poll(&pfd, 1, (int)timeout_ms) <= 0 ||
+            getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &elen) < 0 || err != 0) {
+            close(sock);
+            return -1;
+        }
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+    return sock;
+}
+
+// o destino pode ser tentado agora? com o disjuntor aberto so quando vence a espera, como sondagem
+int breaker_allow(breaker *b, long agora) {
+    if (b->retry_at_ms > agora) return 0;
+    if (b->state == PEER_DOWN) b->state = PEER_PROBING;
+    return 1;
+}
+
+// registra o resultado de uma tentativa
+// retorna -1 se o destino acabou de cair, 1 se acabou de voltar, 0 sem mudanca
+int breaker_result(breaker *b, int ok, long agora) {
+    int antes = b->state;
+    if (ok) {
+        b->state = PEER_UP;
+        b->fails = 0;
+        b->backoff_ms = 0;
+        b->retry_at_ms = 0;
+        return antes != PEER_UP;
+    }
+    b->fails++;
+    if (b->state == PEER_UP) {
+        b->retry_at_ms = agora + RECONNECT_MS;
+        if (b->fails < BREAKER_FAILS) return 0;
+        b->state = PEER_DOWN; // para de tentar, so sonda
+        b->backoff_ms = RECONNECT_MS;
+        b->retry_at_ms = agora + b->backoff_ms;
+        return -1;
+    }
+    // sondagem falhou, dobra a espera
+    b->state = PEER_DOWN;
+    b->backoff_ms = b->backoff_ms * 2 < BACKOFF_MAX_MS ? b->backoff_ms * 2 : BACKOFF_MAX_MS;
+    b->retry_at_ms = agora + b->backoff_ms;
+    return 0;
+}
+
+// verifica se o outro lado fechou a conexao (node caiu ou reiniciou)
+// o node vizinho nunca escreve nesse socket, entao qualquer leitura indica fim
+int peer_conn_dead(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0) return 1;
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return 1;
+    return 0;
+}
+
+// tenta escrever o resto do quadro, retorna 1 se terminou, 0 se falta, -1 se a conexao quebrou
+int pending_write(pending_send *q) {
+    peer_conn *p = &peers[q->b->target_id];
+    const char *frame = q->b->frame;
+    size_t len = q->b->flen;
+    while (q->sent < len) {
+        ssize_t n = send(p->fd, frame + q->sent, len - q->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            q->sent += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;
+    }
+    return 1;
+}
+
+// formato no fio (igual em qualquer compilador ou arquitetura):
+//   quadro   = versao (1 byte) | tamanho do conteudo (varint) | conteudo
+//   conteudo = quantidade de mensagens (varint) | mensagens
+//   mensagem = tipo | origem | numero da proposta | valor | instancia | grupo, cada campo um varint
+// inteiros com sinal passam por zigzag para que -1 ocupe um byte
+
+// escreve v em grupos de 7 bits, bit alto ligado indica que vem mais byte
+size_t put_varint(char *dst, uint32_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        dst[n++] = (char)(v | 0x80);
+        v >>= 7;
+    }
+    dst[n++] = (char)v;
+    return n;
+}
+
+// le um varint, retorna quantos bytes usou ou 0 se estiver incompleto ou for invalido
+size_t get_varint(const char *src, size_t len, uint32_t *v) {
+    uint32_t r = 0;
+    for (size_t i = 0; i < len && i < 5; i++) {
+        uint8_t b = (uint8_t)src[i];
+        r |= (uint32_t)(b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+            *v = r;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+int32_t unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// codifica uma mensagem, retorna os bytes usados (no maximo MSG_WIRE_MAX)
+size_t encode_msg(char *dst, const msg *m) {
+    size_t n = 0;
+    n += put_varint(dst + n, (uint32_t)m->type);
+    n += put_varint(dst + n, zigzag(m->from_id));
+    n += put_varint(dst + n, zigzag(m->proposal_num));
+    n += put_varint(dst + n, zigzag(m->proposal_val));
+    n += put_varint(dst + n, zigzag(m->slot));
+    n += put_varint(dst + n, zigzag(m->group));
+    return n;
+}
+
+// decodifica uma mensagem, retorna os bytes usados ou 0 se estiver truncada ou vier de origem invalida
+size_t decode_msg(const char *src, size_t len, msg *m) {
+    uint32_t f[MSG_FIELDS];
+    size_t off = 0;
+    for (int i = 0; i < MSG_FIELDS; i++) {
+        size_t k = get_varint(src + off, len - off, &f[i]);
+        if (k == 0) return 0;
+        off += k;
+    }
+    m->type = (enum msg_type)f[0];
+    m->from_id = unzigzag(f[1]);
+    m->proposal_num = unzigzag(f[2]);
+    m->proposal_val = unzigzag(f[3]);
+    m->slot = unzigzag(f[4]);
+    m->group = unzigzag(f[5]);
+    // entre nodes a origem indexa vetores [NODES + 1]; do cliente vem 0 ou, no CLIENT_KV, a operacao
+    if (m->type < CLIENT_PROPOSE ? m->from_id < 1 || m->from_id > NODES : m->from_id < 0) return 0;
+    return off;
+}
+
+// monta um quadro (envelope) com n mensagens em dst, retorna quantos bytes ocupou
+size_t encode_frame(char *dst, const msg *ms, int n) {
+    char body[5 + MAX_BATCH * MSG_WIRE_MAX];
+    size_t blen = put_varint(body, (uint32_t)n);
+    for (int i = 0; i < n; i++) blen += encode_msg(body + blen, &ms[i]);
+    size_t off = 0;
+    dst[off++] = WIRE_VERSION;
+    off += put_varint(dst + off, (uint32_t)blen);
+    memcpy(dst + off, body, blen);
+    return off + blen;
+}
+
+// no udp o envio nao diz se o vizinho esta vivo: ele conta como vivo enquanto responde. Mandar a ele
+// ha mais de PEER_SILENT_MS sem receber nada dele depois e falha para o disjuntor, senao um node morto
+// nunca ficaria PEER_DOWN (eleicao, failover dos grupos e heartbeats contam com isso). So a peer_io chama
+int udp_peer_answering(int target, long agora) {
+    static long sem_resposta[NODES + 1]; // primeiro envio sem nada recebido do vizinho depois dele
+    if (last_recv_ms[target] >= sem_resposta[target]) sem_resposta[target] = agora;
+    return agora - sem_resposta[target] < PEER_SILENT_MS;
+}
+
+// manda o lote de cada vizinho num datagrama, todos de uma vez com sendmmsg
+void udp_send_batches(out_batch *bs, int nb) {
+    struct mmsghdr mm[NODES];
+    struct iovec iov[NODES];
+    struct sockaddr_in addr[NODES];
+    for (int k = 0; k < nb; k++) {
+        out_batch *b = &bs[k];
+        addr[k] = (struct sockaddr_in){ .sin_family = AF_INET,
+            .sin_port = htons(BASE_PORT + b->target_id),
+            .sin_addr.s_addr = inet_addr("127.0.0.1") };
+        b->flen = encode_frame(b->frame, b->ms, b->n);
+        iov[k].iov_base = b->frame;
+        iov[k].iov_len = b->flen;
+        memset(&mm[k], 0, sizeof(mm[k]));
+        mm[k].msg_hdr.msg_name = &addr[k];
+        mm[k].msg_hdr.msg_namelen = sizeof(addr[k]);
+        mm[k].msg_hdr.msg_iov = &iov[k];
+        mm[k].msg_hdr.msg_iovlen = 1;
+        b->sent = b->n; // datagrama perdido nao volta para a fila, o timeout do protocolo reenvia
+    }
+    int sent = 0;
+    while (sent < nb) {
+        int r = sendmmsg(udp_sock, mm + sent, nb - sent, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        sent += r;
+    }
+}
+
+// futex entre processos (sem FUTEX_PRIVATE_FLAG, o segmento e compartilhado)
+long futex(_Atomic uint32_t *addr, int op, uint32_t val) {
+    return syscall(SYS_futex, (uint32_t *)addr, op, val, NULL, NULL, 0);
+}
+
+// coloca os lotes nos aneis node_id -> destino e acorda cada destino que estiver dormindo
+// so a peer_io escreve nos aneis deste node, entao ha um produtor por anel
+// anel cheio entrega o que couber; o resto fica na fila de saida para a proxima tentativa.
+// Se o destino consumiu algo desde o ultimo anel cheio, e backpressure; sem progresso e falha
+void shm_send_batches(int node_id, out_batch *bs, int nb) {
+    static uint32_t head_cheio[NODES + 1]; // head visto no ultimo anel cheio, por destino
+    for (int k = 0; k < nb; k++) {
+        out_batch *b = &bs[k];
+        int dst = b->target_id;
+        shm_ring *r = &shm->rings[node_id][dst];
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        b->sent = 0;
+        while (b->sent < b->n && tail - head < SHM_RING_SLOTS) {
+            r->slots[tail & (SHM_RING_SLOTS - 1)] = b->ms[b->sent++];
+            tail++;
+        }
+        if (b->sent < b->n) {
+            b->backpressure = head != head_cheio[dst];
+            head_cheio[dst] = head;
+        }
+        if (b->sent == 0) continue;
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+        atomic_fetch_add(&shm->doorbell[dst], 1);
+        if (atomic_load(&shm->waiting[dst])) futex(&shm->doorbell[dst], FUTEX_WAKE, 1);
+    }
+}
+
+// cria o anel do io_uring e mapeia as filas de submissao e conclusao
+int uring_setup(uring *u, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) return -1;
+    size_t sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    int single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_sz > sq_sz) sq_sz = cq_sz;
+    char *sq = mmap(NULL, sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    char *cq = single ? sq : mmap(NULL, cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || u->sqes == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->entries = p.sq_entries;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->sq_local_tail = *u->sq_tail;
+    u->to_submit = 0;
+    return 0;
+}
+
+// publica as sqes preenchidas e entra no kernel uma vez, esperando min_complete conclusoes
+int uring_enter(uring *u, unsigned min_complete) {
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    int r;
+    do {
+        r = syscall(__NR_io_uring_enter, u->fd, u->to_submit, min_complete,
+                    min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (r < 0 && errno == EINTR);
+    if (r > 0) u->to_submit -= r;
+    return r;
+}
+
+// reserva uma sqe zerada, submetendo as pendentes se a fila estiver cheia
+struct io_uring_sqe *uring_sqe(uring *u) {
+    while (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) {
+        uring_enter(u, 0);
+    }
+    unsigned idx = u->sq_local_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    u->to_submit++;
+    return sqe;
+}
+
+// proxima conclusao disponivel ou NULL, sem syscall
+struct io_uring_cqe *uring_peek(uring *u) {
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+void uring_cqe_seen(uring *u) {
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t ur_data(int op, int target, unsigned gen) {
+    return ((uint64_t)op << 32) | ((uint64_t)(gen & 0xffffff) << 8) | (uint64_t)target;
+}
+
+// fecha o socket de um vizinho no modo io_uring, cancelando a vigia pendente dele
+void uring_drop_peer(int target) {
+    peer_conn *p = &peers[target];
+    if (p->fd < 0) return;
+    if (p->watching) {
+        struct io_uring_sqe *sqe = uring_sqe(&tx_ring);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = ur_data(UR_WATCH, target, p->gen);
+        sqe->user_data = ur_data(UR_CANCEL, target, p->gen);
+    }
+    close(p->fd);
+    p->fd = -1;
+    p->watching = 0;
+    p->gen++;
+}
+
+// trata uma conclusao do anel de envio, retorna 1 se era de um envio deste lote
+int uring_tx_complete(struct io_uring_cqe *cqe) {
+    int op = cqe->user_data >> 32;
+    int target = cqe->user_data & 0xff;
+    unsigned gen = (cqe->user_data >> 8) & 0xffffff;
+    peer_conn *p = &peers[target];
+    int atual = (gen == (p->gen & 0xffffff));
+    if (op == UR_WATCH) {
+        // o vizinho nunca escreve no socket de saida: qualquer evento e fechamento
+        if (atual && cqe->res != -ECANCELED) {
+            p->watching = 0;
+            uring_drop_peer(target);
+        }
+        return 0;
+    }
+    if (op == UR_CANCEL) return 0;
+    if (atual && cqe->res < 0 && (op == UR_CONNECT || op == UR_SEND)) uring_drop_peer(target);
+    return 1; // connect, escrita e timeout de cada cadeia contam para o lote
+}
+
+// envia os lotes para os vizinhos com uma unica entrada no kernel
+// por vizinho: [connect ->] escrita do buffer registrado -> timeout ligado (prazo do vizinho)
+void uring_send_batches(out_batch *bs, int nb) {
+    static struct __kernel_timespec prazo = { 0, SEND_DEADLINE_MS * 1000000L };
+    struct io_uring_cqe *cqe;
+    // vigias de fechamento que dispararam desde o ultimo envio
+    while ((cqe = uring_peek(&tx_ring))) {
+        uring_tx_complete(cqe);
+        uring_cqe_seen(&tx_ring);
+    }
+    int esperadas = 0;
+    for (int k = 0; k < nb; k++) {
+        int t = bs[k].target_id;
+        peer_conn *p = &peers[t];
+        size_t len = tx_len[t] = encode_frame(tx_bufs[t], bs[k].ms, bs[k].n);
+        bs[k].sent = 0;
+        struct io_uring_sqe *sqe;
+        if (p->fd < 0) {
+            p->fd = socket(AF_INET, SOCK_STREAM, 0);
+            int one = 1;
+            setsockopt(p->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            sqe = uring_sqe(&tx_ring);
+            sqe->opcode = IORING_OP_CONNECT;
+            sqe->fd = p->fd;
+            sqe->addr = (uintptr_t)&peer_addrs[t];
+            sqe->off = sizeof(peer_addrs[t]);
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = ur_data(UR_CONNECT, t, p->gen);
+            esperadas++;
+        }
+        sqe = uring_sqe(&tx_ring);
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = p->fd;
+        sqe->addr = (uintptr_t)tx_bufs[t];
+        sqe->len = len;
+        sqe->buf_index = t;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = ur_data(UR_SEND, t, p->gen);
+        sqe = uring_sqe(&tx_ring);
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->addr = (uintptr_t)&prazo;
+        sqe->len = 1;
+        sqe->user_data = ur_data(UR_TIMEOUT, t, p->gen);
+        esperadas += 2;
+    }
+    // uma syscall submete tudo; so repete se alguma conclusao atrasar
+    while (esperadas > 0) {
+        if (uring_enter(&tx_ring, 1) < 0) break;
+        while ((cqe = uring_peek(&tx_ring))) {
+            int op = cqe->user_data >> 32;
+            int t = cqe->user_data & 0xff;
+            if (op == UR_SEND && cqe->res >= 0 && cqe->res != (int)tx_len[t]) {
+                cqe->res = -EIO; // escrita parcial quebra o quadro, reabre a conexao
+            }
+            esperadas -= uring_tx_complete(cqe);
+            if (op == UR_SEND && cqe->res >= 0) {
+                for (int k = 0; k < nb; k++) if (bs[k].target_id == t) bs[k].sent = bs[k].n;
+            }
+            if (op == UR_SEND && cqe->res >= 0 && !peers[t].watching) {
+                // conexao ok: vigia o fechamento pelo proprio anel, sem recv de teste a cada envio
+                struct io_uring_sqe *sqe = uring_sqe(&tx_ring);
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->fd = peers[t].fd;
+                sqe->poll32_events = POLLIN | POLLRDHUP;
+                sqe->user_data = ur_data(UR_WATCH, t, peers[t].gen);
+                peers[t].watching = 1;
+            }
+            uring_cqe_seen(&tx_ring);
+        }
+    }
+    if (tx_ring.to_submit > 0) uring_enter(&tx_ring, 0); // vigias e cancelamentos novos
+}
+
+// prepara os aneis de envio e recepcao, retorna -1 se o kernel nao tiver io_uring
+int uring_init(void) {
+    if (uring_setup(&rx_ring, URING_ENTRIES) < 0) return -1;
+    if (uring_setup(&tx_ring, URING_ENTRIES) < 0) return -1;
+    // buffers de envio registrados uma vez, o kernel nao precisa mapear a cada escrita
+    struct iovec iov[NODES + 1];
+    for (int i = 0; i <= NODES; i++) {
+        iov[i].iov_base = tx_bufs[i];
+        iov[i].iov_len = sizeof(tx_bufs[i]);
+        peer_addrs[i] = (struct sockaddr_in){ .sin_family = AF_INET,
+            .sin_port = htons(BASE_PORT + i),
+            .sin_addr.s_addr = inet_addr("127.0.0.1") };
+    }
+    if (syscall(__NR_io_uring_register, tx_ring.fd, IORING_REGISTER_BUFFERS, iov, NODES + 1) < 0) return -1;
+    return 0;
+}
+
+// envia o lote de cada vizinho ao mesmo tempo pelo tcp
+// connects e escritas sao nao bloqueantes e esperados juntos num unico poll com prazo,
+// entao um vizinho lento ou morto nao atrasa a entrega para os outros
+void tcp_send_batches(out_batch *bs, int nb) {
+    pending_send ps[NODES];
+    int np = 0;
+    for (int k = 0; k < nb; k++) {
+        out_batch *b = &bs[k];
+        peer_conn *p = &peers[b->target_id];
+        b->flen = encode_frame(b->frame, b->ms, b->n);
+        b->sent = 0;
+        if (p->fd >= 0 && peer_conn_dead(p->fd)) {
+            close(p->fd); // node vizinho reiniciou ou caiu
+            p->fd = -1;
+        }
+        int connecting = 0, retried = 0;
+        if (p->fd < 0) {
+            p->fd = peer_connect_start(b->target_id, &connecting);
+            retried = 1; // conexao nova, nao adianta reabrir de novo
+        }
+        if (p->fd < 0) continue; // node fora do ar
+        ps[np++] = (pending_send){ b, connecting, retried, 0 };
+    }
+
+    long deadline = now_ms() + SEND_DEADLINE_MS;
+    while (np > 0) {
+        // escreve em quem ja esta conectado
+        for (int k = 0; k < np; ) {
+            pending_send *q = &ps[k];
+            peer_conn *p = &peers[q->b->target_id];
+            int r = q->connecting ? 0 : pending_write(q);
+            if (r < 0) {
+                close(p->fd);
+                p->fd = -1;
+                if (!q->retried) {
+                    // conexao antiga quebrou, reabre uma vez e manda o quadro inteiro de novo
+                    p->fd = peer_connect_start(q->b->target_id, &q->connecting);
+                    q->retried = 1;
+                    q->sent = 0;
+                    if (p->fd >= 0) continue;
+                }
+            }
+            if (r > 0) q->b->sent = q->b->n;
+            if (r != 0) {
+                ps[k] = ps[--np]; // terminou ou desistiu deste vizinho
+                continue;
+            }
+            k++;
+        }
+        long left = deadline - now_ms();
+        if (np == 0 || left <= 0) break;
+
+        // espera algum connect terminar ou algum socket aceitar mais bytes
+        struct pollfd pfd[NODES];
+        for (int k = 0; k < np; k++) {
+            pfd[k].fd = peers[ps[k].b->target_id].fd;
+            pfd[k].events = POLLOUT;
+            pfd[k].revents = 0;
+        }
+        if (poll(pfd, np, (int)left) < 0 && errno != EINTR) break;
+        for (int k = 0; k < np; k++) {
+            if (!ps[k].connecting || pfd[k].revents == 0) continue;
+            int err = 0;
+            socklen_t elen = sizeof(err);
+            getsockopt(pfd[k].fd, SOL_SOCKET, SO_ERROR, &err, &elen);
+            ps[k].connecting = 0;
+            if (err != 0) ps[k].retried = 1; // connect recusado, o write seguinte descarta
+        }
+    }
+    // prazo esgotado: connect pendurado ou quadro pela metade, a conexao nao serve mais
+    for (int k = 0; k < np; k++) {
+        peer_conn *p = &peers[ps[k].b->target_id];
+        close(p->fd);
+        p->fd = -1;
+    }
+}
+
+// coloca a mensagem na fila de saida de cada destino, sem bloquear
+// fila cheia descarta a mensagem mais antiga (a mais nova e a que importa para o protocolo)
+// retorna SEND_CONGESTED se algum destino esta acima da marca alta, SEND_DROPPED se algum descartou
+int send_to_peers(const int *targets, int n, msg *m) {
+    int st = SEND_OK;
+    long agora = now_ms();
+    pthread_mutex_lock(&outq_mtx);
+    for (int k = 0; k < n; k++) {
+        peer_conn *p = &peers[targets[k]];
+        last_sent_ms[targets[k]] = agora; // enlace ativo dispensa heartbeat
+        if (p->size == OUTQ_CAPACITY) {
+            p->head = (p->head + 1) % OUTQ_CAPACITY;
+            p->size--;
+            p->first_seq++;
+            p->dropped++;
+            st = SEND_DROPPED;
+        }
+        p->outq[(p->head + p->size) % OUTQ_CAPACITY] = *m;
+        p->size++;
+        if (p->size >= outq_high) p->congested = 1;
+        if (p->congested && st == SEND_OK) st = SEND_CONGESTED;
+    }
+    pthread_cond_signal(&outq_cond);
+    pthread_mutex_unlock(&outq_mtx);
+    return st;
+}
+
+// envia uma mensagem para outro node paxos identificado por target_id
+int send_msg(int target_id, msg *m) {
+    return send_to_peers(&target_id, 1, m);
+}
+
+// envia a mensagem para todos os outros nodes em paralelo
+int broadcast_msg(int node_id, msg *m) {
+    int targets[NODES];
+    int n = 0;
+    for (int i = 1; i <= NODES; i++) if (i != node_id) targets[n++] = i;
+    return send_to_peers(targets, n, m);
+}
+
+// saude do vizinho segundo o disjuntor (PEER_UP, PEER_DOWN ou PEER_PROBING)
+int peer_health(int target_id) {
+    pthread_mutex_lock(&outq_mtx);
+    int h = peers[target_id].br.state;
+    pthread_mutex_unlock(&outq_mtx);
+    return h;
+}
+
+// vizinho com a fila de saida acima da marca alta
+int peer_congested(int target_id) {
+    pthread_mutex_lock(&outq_mtx);
+    int c = peers[target_id].congested;
+    pthread_mutex_unlock(&outq_mtx);
+    return c;
+}
+
+// mensagens esperando na fila de saida do vizinho
+int peer_backlog(int target_id) {
+    pthread_mutex_lock(&outq_mtx);
+    int n = peers[target_id].size;
+    pthread_mutex_unlock(&outq_mtx);
+    return n;
+}
+
+// vizinho vivo e com espaco na fila (chamar com outq_mtx)
+int peer_writable(peer_conn *p) {
+    return !p->congested && p->br.state != PEER_DOWN;
+}
+
+// quantos vizinhos estao vivos e com a fila de saida abaixo da marca alta
+int writable_peers(int node_id) {
+    int n = 0;
+    pthread_mutex_lock(&outq_mtx);
+    for (int i = 1; i <= NODES; i++) if (i != node_id && peer_writable(&peers[i])) n++;
+    pthread_mutex_unlock(&outq_mtx);
+    return n;
+}
+
+// backpressure: espera ate need vizinhos vivos terem espaco na fila de saida
+void wait_writable(int node_id, int need) {
+    pthread_mutex_lock(&outq_mtx);
+    while (1) {
+        int n = 0;
+        for (int i = 1; i <= NODES; i++) if (i != node_id && peer_writable(&peers[i])) n++;
+        if (n >= need) break;
+        pthread_cond_wait(&outq_space, &outq_mtx);
+    }
+    pthread_mutex_unlock(&outq_mtx);
+}
+
+// thread que esvazia as filas de saida: tira um lote de cada vizinho pronto
+// e entrega todos de uma vez pelo transporte escolhido
+void *peer_io(void *arg) {
+    int node_id = (int)(intptr_t)arg;
+    static out_batch bs[NODES];
+    while (1) {
+        pthread_mutex_lock(&outq_mtx);
+        int nb = 0;
+        while (1) {
+            long agora = now_ms(), proxima = -1;
+            for (int i = 1; i <= NODES; i++) {
+                peer_conn *p = &peers[i];
+                if (p->size == 0) continue;
+                if (!breaker_allow(&p->br, agora)) {
+                    // disjuntor aberto ou esperando nova tentativa: nao gasta connect com ele
+                    if (proxima < 0 || p->br.retry_at_ms < proxima) proxima = p->br.retry_at_ms;
+                    continue;
+                }
+                out_batch *b = &bs[nb++];
+                b->target_id = i;
+                b->n = p->size < MAX_BATCH ? p->size : MAX_BATCH;
+                b->first_seq = p->first_seq;
+                b->backpressure = 0;
+                for (int k = 0; k < b->n; k++) b->ms[k] = p->outq[(p->head + k) % OUTQ_CAPACITY];
+            }
+            if (nb > 0) break;
+            if (proxima < 0) {
+                pthread_cond_wait(&outq_cond, &outq_mtx);
+            } else {
+                // so ha vizinhos esperando nova tentativa
+                struct timespec until;
+                clock_gettime(CLOCK_REALTIME, &until);
+                long ms = proxima - agora;
+                until.tv_sec += ms / 1000;
+                until.tv_nsec += (ms % 1000) * 1000000L;
+                if (until.tv_nsec >= 1000000000L) {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000L;
+                }
+                pthread_cond_timedwait(&outq_cond, &outq_mtx, &until);
+            }
+        }
+        pthread_mutex_unlock(&outq_mtx);
+
+        if (transport == TRANSPORT_UDP) udp_send_batches(bs, nb);
+        else if (transport == TRANSPORT_SHM) shm_send_batches(node_id, bs, nb);
+        else if (transport == TRANSPORT_URING) uring_send_batches(bs, nb);
+        else tcp_send_batches(bs, nb);
+        long saiu = 0;
+        for (int k = 0; k < nb; k++) saiu += bs[k].sent;
+        atomic_fetch_add_explicit(&msgs_sent, saiu, memory_order_relaxed);
+
+        pthread_mutex_lock(&outq_mtx);
+        int liberou = 0;
+        long agora = now_ms();
+        for (int k = 0; k < nb; k++) {
+            out_batch *b = &bs[k];
+            peer_conn *p = &peers[b->target_id];
+            // mensagens descartadas enquanto o lote estava fora ja sairam da fila
+            long tirar = (long)(b->first_seq + b->sent) - (long)p->first_seq;
+            if (tirar > p->size) tirar = p->size;
+            if (tirar > 0) {
+                p->head = (p->head + tirar) % OUTQ_CAPACITY;
+                p->size -= tirar;
+                p->first_seq += tirar;
+            }
+            // entregou alguma coisa conta como vivo; nada entregue e falha (fora do ar ou travado),
+            // menos o anel shm cheio de um destino que continua consumindo
+            int entregou = transport == TRANSPORT_UDP ? udp_peer_answering(b->target_id, agora) : b->sent > 0;
+            int mudou = b->sent == 0 && b->backpressure ? 0 : breaker_result(&p->br, entregou, agora);
+            if (b->sent < b->n && (b->sent > 0 || b->backpressure))
+                p->br.retry_at_ms = agora + RECONNECT_MS; // lento, espera esvaziar
+            if (mudou < 0) printf("[Node %d] vizinho %d fora do ar, sondando com espera\n", node_id, b->target_id);
+            if (mudou > 0) {
+                printf("[Node %d] vizinho %d de volta\n", node_id, b->target_id);
+                liberou = 1;
+            }
+            if (p->congested && p->size <= outq_low) {
+                p->congested = 0;
+                liberou = 1;
+            }
+        }
+        if (liberou) pthread_cond_broadcast(&outq_space);
+        pthread_mutex_unlock(&outq_mtx);
+    }
+    return NULL;
+}
+
+// envia uma linha de log para o monitor
+void send_monitor(const char *line) {
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET,
+        .sin_port = htons(MONITOR_PORT),
+        .sin_addr.s_addr = inet_addr("127.0.0.1") };
+    sendto(sock, line, strlen(line), 0, (struct sockaddr*)&addr, sizeof(addr)); // envia log
+    close(sock);
+}
+
+// gera um timestamp formatado para logs
+void timestamp(char *buf, size_t sz) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct tm *tm = localtime(&tv.tv_sec);
+    strftime(buf, sz, "%Y-%m-%dT%H:%M:%S", tm);
+    int ms = tv.tv_usec/1000;
+    snprintf(buf + strlen(buf), sz - strlen(buf), ".%03d", ms);
+}
+
+// escreve todos os bytes num socket bloqueante do cliente
+int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// le exatamente len bytes de um socket bloqueante, retorna -1 se a conexao fechou antes
+int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// le um quadro inteiro de um socket bloqueante e devolve a primeira mensagem dele
+int read_frame_msg(int fd, msg *m) {
+    char hdr[FRAME_HDR_MAX], body[MAX_FRAME];
+    size_t h = 0;
+    uint32_t blen = 0, count = 0;
+    if (read_full(fd, hdr, 1) < 0 || (uint8_t)hdr[0] != WIRE_VERSION) return -1;
+    // tamanho em varint: le byte a byte ate o ultimo
+    do {
+        if (h >= FRAME_HDR_MAX - 1 || read_full(fd, hdr + 1 + h, 1) < 0) return -1;
+        h++;
+    } while (hdr[h] & 0x80);
+    if (get_varint(hdr + 1, h, &blen) == 0 || blen > MAX_FRAME) return -1;
+    if (read_full(fd, body, blen) < 0) return -1;
+    size_t off = get_varint(body, blen, &count);
+    if (off == 0 || count == 0) return -1;
+    return decode_msg(body + off, blen - off, m) > 0 ? 0 : -1;
+}
+
+static breaker client_br, client_ack_br; // saude das portas do cliente
+
+// conecta no cliente com connect nao bloqueante, tentando com espera crescente ate CLIENT_DEADLINE_MS
+// com o disjuntor aberto desiste na hora ate a proxima sondagem
+int client_connect(int port, breaker *br) {
+    long agora = now_ms(), deadline = agora + CLIENT_DEADLINE_MS, espera = 10;
+    if (!breaker_allow(br, agora)) return -1;
+    while (1) {
+        long left = deadline - now_ms();
+        int sock = left > 0 ? connect_deadline(port, left) : -1;
+        if (sock >= 0) {
+            breaker_result(br, 1, now_ms());
+            return sock;
+        }
+        if (deadline - now_ms() <= espera) break;
+        usleep(espera * 1000); // cliente ainda nao esta ouvindo
+        espera = espera * 2 < 200 ? espera * 2 : 200;
+    }
+    breaker_result(br, 0, now_ms());
+    return -1;
+}
+
+// informa ao cliente o lider eleito, retorna -1 se o cliente nao estava ouvindo
+int inform_client(int elected_id) {
+    int sock = client_connect(CLIENT_PORT, &client_br);
+    if (sock < 0) return -1;
+    msg m = { CLIENT_LEADER, elected_id, 0, elected_id, 0, 0 };
+    char frame[FRAME_MAX_BYTES];
+    write_full(sock, frame, encode_frame(frame, &m, 1)); // envia id do lider
+    close(sock);
+    return 0;
+}
+
+// as respostas saem pela thread client_replier: o connect no cliente (ate CLIENT_DEADLINE_MS com ele
+// ausente) nao pode parar a thread paxos que aplica as instancias. Fila cheia descarta a resposta,
+// o cliente reenvia o comando quando o prazo dele estoura
+void queue_reply(int node_id, msg *m) {
+    if (!enqueue_wait(&reply_q, m, 0))
+        printf("[Node %d] fila de respostas cheia, resposta do valor %d descartada\n", node_id, m->proposal_val);
+}
+
+// envia confirmação ao cliente de que o valor foi aceito 
+void send_client_ok(int node_id, int value) {
+    msg ok = { CLIENT_OK, 0, 0, value, 0, 0 };
+    queue_reply(node_id, &ok);
+}
+
+// envia ao cliente o resultado de um comando da maquina chave-valor (slot = chave)
+void send_client_result(int node_id, int key, const sm_result *res) {
+    msg r = { CLIENT_RESULT, 0, res->status, res->value, key, 0 };
+    queue_reply(node_id, &r);
+}
+
+// thread que entrega ao cliente as respostas enfileiradas por send_client_ok / send_client_result
+void *client_replier(void *arg) {
+    (void)arg;
+    while (1) {
+        msg m;
+        dequeue(&reply_q, &m);
+        int sock = client_connect(CLIENT_ACK_PORT, &client_ack_br);
+        if (sock < 0) continue;
+        char frame[FRAME_MAX_BYTES];
+        write_full(sock, frame, encode_frame(frame, &m, 1)); // envia confirmação ou resultado
+        close(sock);
+    }
+    return NULL;
+}
+
+// lider do grupo: os grupos giram a partir do lider eleito, entao cada node lidera alguns;
+// vizinho fora do ar e pulado e o proximo assume (dois nodes achando que lideram so disputam propostas)
+int group_leader(int group) {
+    if (leader_id < 1) return -1;
+    for (int k = 0; k < NODES; k++) {
+        int cand = (leader_id - 1 + group + k) % NODES + 1;
+        if (peer_health(cand) != PEER_DOWN) return cand;
+    }
+    return leader_id;
+}
+
+// grupo dono de uma chave (hoje a chave e o proprio valor proposto)
+int group_of(int key) {
+    return (int)((unsigned)key % (unsigned)ngroups);
+}
+
+// inicializa o estado de um grupo
+void group_init(paxos_group *g, int id) {
+    g->id = id;
+    queue_init(&g->inbox);
+    queue_init(&g->proposals);
+    g->next_slot = 1;
+    g->read_barrier = INT_MAX;
+    g->lease_holder = -1;
+    pthread_mutex_init(&g->state_mtx, NULL);
+    pthread_mutex_init(&g->lease_mtx, NULL);
+    pthread_mutex_init(&g->store_mtx, NULL);
+}
+
+// lider: comeca uma rodada de renovacao do lease se faltar menos de meio lease
+// retorna o numero da rodada para ir nos heartbeats, ou 0 se o lease ainda esta folgado
+int lease_start_round(paxos_group *g, long agora) {
+    int round = 0;
+    pthread_mutex_lock(&g->lease_mtx);
+    if (g->lease_until - agora < LEASE_MS / 2) {
+        round = ++g->lease_round;
+        g->lease_round_ms = agora;
+        g->lease_acks = 1; // ja conta o lider
+        memset(g->lease_acked, 0, sizeof(g->lease_acked));
+    }
+    pthread_mutex_unlock(&g->lease_mtx);
+    return round;
+}
+
+// lider: LEASE_ACK de um seguidor; o lease vale LEASE_MS a partir do envio da rodada quando os que
+// confirmaram (com o lider) cruzam todo quorum de fase 1 possivel, ou seja sao NODES - q1 + 1
+// (o seguidor conta a partir do recebimento, que e depois, entao a promessa dele dura mais)
+void lease_on_ack(paxos_group *g, msg *m) {
+    pthread_mutex_lock(&g->lease_mtx);
+    if (m->proposal_num == g->lease_round && m->from_id >= 1 && m->from_id <= NODES && !g->lease_acked[m->from_id]) {
+        g->lease_acked[m->from_id] = 1;
+        if (++g->lease_acks >= NODES - q1 + 1 && g->lease_round_ms + LEASE_MS - LEASE_DRIFT_MS > g->lease_until)
+            g->lease_until = g->lease_round_ms + LEASE_MS - LEASE_DRIFT_MS;
+    }
+    pthread_mutex_unlock(&g->lease_mtx);
+}
+
+// lider: mandato novo, o lease antigo nao vale ate o quorum do lease confirmar de novo
+void lease_reset(paxos_group *g) {
+    pthread_mutex_lock(&g->lease_mtx);
+    g->lease_until = 0;
+    pthread_mutex_unlock(&g->lease_mtx);
+}
+
+// seguidor: concede o lease a from se ele e o lider conhecido, o mandato dele (ballot) nao foi superado
+// por uma proposta que este node ja prometeu e nao ha lease de outro node valendo
+// (o breaker pode mostrar como lider um node que outro ja substituiu)
+int lease_grant(paxos_group *g, int from, int ballot) {
+    long agora = now_ms();
+    pthread_mutex_lock(&g->lease_mtx);
+    int ok = from == group_leader(g->id) && ballot > 0 && ballot >= g->promised_num &&
+             (from == g->lease_holder || agora >= g->lease_granted_until);
+    if (ok) {
+        g->lease_holder = from;
+        g->lease_granted_until = agora + LEASE_MS;
+    }
+    pthread_mutex_unlock(&g->lease_mtx);
+    return ok;
+}
+
+// seguidor: 1 enquanto o lease concedido ao lider atual vale
+int lease_active(paxos_group *g) {
+    pthread_mutex_lock(&g->lease_mtx);
+    int ativo = g->lease_holder == group_leader(g->id) && now_ms() < g->lease_granted_until;
+    pthread_mutex_unlock(&g->lease_mtx);
+    return ativo;
+}
+
+// quanto o PREPARE de from ainda espera pelo lease concedido (<= 0 = pode prometer), o lider antigo ainda pode estar lendo
+// o lider antigo tambem espera o proprio lease, ele conta no quorum do lease como quem confirmou
+long lease_wait(int node_id, paxos_group *g, int from) {
+    pthread_mutex_lock(&g->lease_mtx);
+    long agora = now_ms();
+    long espera = from != g->lease_holder ? g->lease_granted_until - agora : 0;
+    if (from != node_id && g->lease_until - agora > espera) espera = g->lease_until - agora;
+    pthread_mutex_unlock(&g->lease_mtx);
+    return espera;
+}
+
+// node que vai comecar um mandato espera vencer o lease que concedeu ao lider antigo
+void lease_hold_off(int node_id, paxos_group *g, int from) {
+    long espera = lease_wait(node_id, g, from);
+    if (espera <= 0) return;
+    printf("[Node %d] PREPARE do node %d espera %ld ms pelo lease do node %d\n", node_id, from, espera, g->lease_holder);
+    usleep(espera * 1000);
+}
+
+// valor esta entre os estados conhecidos
+int known_value(int val) {
+    for (int i = 0; i < KNOWN_STATES; i++) {
+        if (known_states[i] == val) return 1;
+    }
+    return 0;
+}
+
+// maquina padrao: um registrador por grupo, cada comando e um valor conhecido que substitui o anterior
+int register_encode(const msg *m, int *cmd) {
+    cmd[0] = m->proposal_val;
+    return known_value(cmd[0]);
+}
+
+int register_valid(const int *cmd) {
+    return known_value(cmd[0]);
+}
+
+void register_apply(paxos_group *g, const int *cmd, sm_result *res) {
+    res->status = SM_OK;
+    res->value = g->applied_value;
+    g->applied_value = cmd[0];
+}
+
+void register_read(paxos_group *g, int key, sm_result *res) {
+    (void)key; // o registrador e um so para o grupo todo
+    res->status = SM_OK;
+    res->value = g->applied_value;
+}
+
+int32_t *register_save(paxos_group *g, int *nwords) {
+    int32_t *w = malloc(sizeof(int32_t));
+    w[0] = g->applied_value;
+    *nwords = 1;
+    return w;
+}
+
+void register_load(paxos_group *g, const int32_t *words, int nwords) {
+    g->applied_value = nwords > 0 ? words[0] : 0;
+}
+
+void register_reply(int node_id, const int *cmd, const sm_result *res) {
+    (void)res;
+    // consenso atingido, informa o cliente
+    printf("[Node %d] CONSENSUS on %d\n", node_id, cmd[0]);
+    send_client_ok(node_id, cmd[0]);
+}
+
+void register_learned(int node_id, const int *cmd, int slot) {
+    printf("[Node %d] aprendeu valor %d (instancia %d)\n", node_id, cmd[0], slot);
+    char ts[32], buf[128];
+    timestamp(ts, sizeof(ts));
+    snprintf(buf, sizeof(buf), "%s,%d,all,LEARN,%d,%d\n", ts, node_id, slot, cmd[0]);
+    send_monitor(buf);
+}
+
+// mistura os bits da chave: chaves em sequencia nao caem em posicoes vizinhas
+uint32_t kv_hash(int32_t key) {
+    uint32_t h = (uint32_t)key * 2654435761u;
+    return h ^ (h >> 16);
+}
+
+// valor da chave dentro do mapa, ou NULL; a sondagem para na primeira posicao nunca usada
+int32_t *kv_get(kv_map *m, int32_t key) {
+    if (m->cap == 0) return NULL;
+    for (uint32_t i = kv_hash(key) & (m->cap - 1);; i = (i + 1) & (m->cap - 1)) {
+        if (m->state[i] == KV_EMPTY) return NULL;
+        if (m->state[i] == KV_FULL && m->keys[i] == key) return &m->vals[i];
+    }
+}
+
+// poe uma chave que nao esta no mapa na primeira posicao livre ou marcada como removida
+void kv_insert(kv_map *m, int32_t key, int32_t val) {
+    uint32_t i = kv_hash(key) & (m->cap - 1);
+    while (m->state[i] == KV_FULL) i = (i + 1) & (m->cap - 1);
+    if (m->state[i] == KV_EMPTY) m->used++;
+    m->state[i] = KV_FULL;
+    m->keys[i] = key;
+    m->vals[i] = val;
+    m->count++;
+}
+
+// refaz o mapa com espaco para mais uma chave e sem as marcas de remocao, carga sempre abaixo de 3/4
+void kv_resize(kv_map *m) {
+    uint32_t cap = m->cap ? m->cap : KV_INITIAL_CAP;
+    while ((m->count + 1) * 2 > cap) cap *= 2;
+    kv_map novo = { malloc(sizeof(int32_t) * cap), malloc(sizeof(int32_t) * cap), calloc(cap, 1), cap, 0, 0 };
+    if (!novo.keys || !novo.vals || !novo.state) {
+        perror("[Node] sem memoria para o mapa chave-valor");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < m->cap; i++) {
+        if (m->state[i] == KV_FULL) kv_insert(&novo, m->keys[i], m->vals[i]);
+    }
+    free(m->keys);
+    free(m->vals);
+    free(m->state);
+    *m = novo;
+}
+
+void kv_put(kv_map *m, int32_t key, int32_t val) {
+    int32_t *v = kv_get(m, key);
+    if (v) {
+        *v = val;
+        return;
+    }
+    if ((m->used + 1) * 4 > m->cap * 3) kv_resize(m);
+    kv_insert(m, key, val);
+}
+
+// retorna 0 se a chave nao estava no mapa
+int kv_delete(kv_map *m, int32_t key) {
+    int32_t *v = kv_get(m, key);
+    if (!v) return 0;
+    m->state[v - m->vals] = KV_DELETED;
+    m->count--;
+    return 1;
+}
+
+void kv_clear(kv_map *m) {
+    free(m->keys);
+    free(m->vals);
+    free(m->state);
+    memset(m, 0, sizeof(*m));
+}
+
+const char *kv_op_name(int op) {
+    static const char *nomes[] = { "?", "GET", "PUT", "DELETE", "CAS" };
+    return op >= KV_GET && op <= KV_CAS ? nomes[op] : nomes[0];
+}
+
+// maquina chave-valor: comando = operacao, chave, valor, valor esperado (so CAS)
+// no fio o CLIENT_KV leva a operacao em from_id, o valor em proposal_num, a chave em proposal_val e o esperado em slot
+int kv_valid(const int *cmd) {
+    return cmd[0] >= KV_GET && cmd[0] <= KV_CAS;
+}
+
+int kv_encode(const msg *m, int *cmd) {
+    cmd[0] = m->from_id;
+    cmd[1] = m->proposal_val;
+    cmd[2] = m->proposal_num;
+    cmd[3] = m->slot;
+    return kv_valid(cmd);
+}
+
+void kv_apply(paxos_group *g, const int *cmd, sm_result *res) {
+    int32_t *v = kv_get(&g->kv, cmd[1]);
+    res->status = v ? SM_OK : SM_NOT_FOUND;
+    res->value = v ? *v : 0;
+    if (cmd[0] == KV_PUT) {
+        kv_put(&g->kv, cmd[1], cmd[2]);
+        res->status = SM_OK;
+    } else if (cmd[0] == KV_DELETE && v) {
+        kv_delete(&g->kv, cmd[1]);
+    } else if (cmd[0] == KV_CAS && v) {
+        if (*v == cmd[3]) *v = cmd[2];
+        else res->status = SM_CAS_FAILED;
+    }
+}
+
+void kv_read(paxos_group *g, int key, sm_result *res) {
+    int32_t *v = kv_get(&g->kv, key);
+    res->status = v ? SM_OK : SM_NOT_FOUND;
+    res->value = v ? *v : 0;
+}
+
+// snapshot: pares chave, valor das chaves presentes
+int32_t *kv_save(paxos_group *g, int *nwords) {
+    int32_t *w = malloc(sizeof(int32_t) * (2 * g->kv.count + 1));
+    int n = 0;
+    for (uint32_t i = 0; i < g->kv.cap; i++) {
+        if (g->kv.state[i] != KV_FULL) continue;
+        w[n++] = g->kv.keys[i];
+        w[n++] = g->kv.vals[i];
+    }
+    *nwords = n;
+    return w;
+}
+
+void kv_load(paxos_group *g, const int32_t *words, int nwords) {
+    kv_clear(&g->kv);
+    for (int i = 0; i + 1 < nwords; i += 2) kv_put(&g->kv, words[i], words[i + 1]);
+}
+
+void kv_reply(int node_id, const int *cmd, const sm_result *res) {
+    printf("[Node %d] CONSENSUS on %s %d (status %d, valor %d)\n", node_id, kv_op_name(cmd[0]), cmd[1], res->status, res->value);
+    send_client_result(node_id, cmd[1], res);
+}
+
+void kv_learned(int node_id, const int *cmd, int slot) {
+    printf("[Node %d] aprendeu %s %d (instancia %d)\n", node_id, kv_op_name(cmd[0]), cmd[1], slot);
+    char ts[32], buf[128];
+    timestamp(ts, sizeof(ts));
+    snprintf(buf, sizeof(buf), "%s,%d,all,LEARN,%d,%d\n", ts, node_id, slot, cmd[1]);
+    send_monitor(buf);
+}
+
+static const state_machine register_sm = {
+    .name = "register", .cmd_len = 1, .request = CLIENT_PROPOSE,
+    .encode = register_encode, .valid = register_valid, .apply = register_apply, .read = register_read,
+    .save = register_save, .load = register_load, .reply = register_reply, .learned = register_learned };
+static const state_machine kv_sm = {
+    .name = "kv", .cmd_len = 4, .request = CLIENT_KV,
+    .encode = kv_encode, .valid = kv_valid, .apply = kv_apply, .read = kv_read,
+    .save = kv_save, .load = kv_load, .reply = kv_reply, .learned = kv_learned };
+static const state_machine *sm = &register_sm; // PAXOS_SM
+
+// aplica os comandos de um lote na maquina de estados, com state_mtx; res recebe o resultado de cada um (ou NULL)
+void sm_apply_batch(paxos_group *g, const int *vals, int n, sm_result *res) {
+    for (int i = 0; i + sm->cmd_len <= n; i += sm->cmd_len) {
+        sm_result r;
+        sm->apply(g, vals + i, res ? &res[i / sm->cmd_len] : &r);
+        g->applied_cmds++;
+    }
+}
+
+// continua o fnv-1a h por mais n bytes, para somar partes que nao estao juntas na memoria
+uint32_t fnv1a_more(uint32_t h, const void *p, size_t n) {
+    const unsigned char *b = p;
+    for (size_t i = 0; i < n; i++) h = (h ^ b[i]) * 16777619u;
+    return h;
+}
+
+uint32_t fnv1a(const void *p, size_t n) {
+    return fnv1a_more(2166136261u, p, n);
+}
+
+// sincroniza o diretorio dos arquivos do node: criacao, rename e remocao so valem depois disso
+void sync_dir(void) {
+    char *dir = getenv("PAXOS_WAL_DIR");
+    int fd = open(dir ? dir : ".", O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+// arquivo do segmento seg do grupo, no mesmo diretorio do WAL
+void store_path(char *buf, size_t sz, int node_id, int group, int seg) {
+    char *dir = getenv("PAXOS_WAL_DIR");
+    snprintf(buf, sz, "%s/paxos_log_%d_%d_%d.seg", dir ? dir : ".", node_id, group, seg);
+}
+
+// posicao do segmento seg no vetor circular, ou NULL fora da janela de SEG_MAX segmentos a partir de seg_first
+log_segment *store_seg(paxos_group *g, int seg) {
+    return seg >= g->seg_first && seg < g->seg_first + SEG_MAX ? &g->segs[seg % SEG_MAX] : NULL;
+}
+
+// mapeia o segmento seg do grupo; com criar = 0 so abre um arquivo que ja existe
+// arquivo novo e esparso, so ocupa disco o que foi gravado
+log_segment *store_segment(int node_id, paxos_group *g, int seg, int criar) {
+    log_segment *sg = store_seg(g, seg);
+    if (!sg) return NULL;
+    if (sg->base) return sg;
+    char path[256];
+    store_path(path, sizeof(path), node_id, g->id, seg);
+    int fd = open(path, O_RDWR | (criar ? O_CREAT : 0), 0644);
+    if (fd < 0 && !criar) return NULL;
+    if (fd < 0 || ftruncate(fd, SEG_BYTES) < 0) {
+        printf("[Node %d] falha ao abrir o segmento %s: %s\n", node_id, path, strerror(errno));
+        exit(1);
+    }
+    void *m = mmap(NULL, SEG_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        printf("[Node %d] falha ao mapear o segmento %s: %s\n", node_id, path, strerror(errno));
+        exit(1);
+    }
+    // a entrada e gravada antes do indice: o fim valido vem da maior instancia indexada
+    uint32_t *idx = m;
+    size_t used = SEG_INDEX_BYTES;
+    int last = 0; // a posicao pode ter sido de um segmento ja compactado
+    for (int i = SEG_SLOTS - 1; i >= 0; i--) {
+        if (idx[i] == 0) continue;
+        store_entry *e = (store_entry *)((char *)m + idx[i]);
+        used = idx[i] + sizeof(store_entry) + sizeof(int32_t) * e->nvals;
+        last = seg * SEG_SLOTS + i + 1;
+        break;
+    }
+    pthread_mutex_lock(&g->store_mtx); // o snapshotter e o catch-up leem os segmentos mapeados
+    sg->base = m;
+    sg->used = used;
+    sg->last = last;
+    pthread_mutex_unlock(&g->store_mtx);
+    return sg;
+}
+
+// instancia decidida guardada, ou NULL; O(1): segmento e posicao no indice saem do numero da instancia
+const store_entry *store_get(paxos_group *g, int slot) {
+    log_segment *sg = slot < 1 ? NULL : store_seg(g, (slot - 1) / SEG_SLOTS);
+    if (!sg || !sg->base) return NULL;
+    uint32_t off = ((uint32_t *)sg->base)[(slot - 1) % SEG_SLOTS];
+    return off ? (const store_entry *)(sg->base + off) : NULL;
+}
+
+// entrada gravada logo depois de e no mesmo segmento, para ler em sequencia direto do mapeamento; NULL no fim
+const store_entry *store_next(paxos_group *g, const store_entry *e) {
+    log_segment *sg = &g->segs[(e->slot - 1) / SEG_SLOTS % SEG_MAX];
+    const char *p = (const char *)e + sizeof(store_entry) + sizeof(int32_t) * e->nvals;
+    return p < sg->base + sg->used ? (const store_entry *)p : NULL;
+}
+
+// desmapeia e apaga os segmentos que o ultimo snapshot ja cobre inteiros; so a thread paxos do grupo chama
+void store_compact(int node_id, paxos_group *g) {
+    char path[256];
+    while (g->snap_index >= (g->seg_first + 1) * SEG_SLOTS) {
+        int seg = g->seg_first;
+        log_segment *sg = &g->segs[seg % SEG_MAX];
+        pthread_mutex_lock(&g->store_mtx); // o catch-up pode estar lendo o segmento
+        if (sg->base) munmap(sg->base, SEG_BYTES);
+        sg->base = NULL;
+        g->seg_first = seg + 1; // a posicao no vetor passa a ser do segmento seg + SEG_MAX
+        pthread_mutex_unlock(&g->store_mtx);
+        store_path(path, sizeof(path), node_id, g->id, seg);
+        unlink(path);
+        printf("[Node %d] grupo %d: segmento %d compactado pelo snapshot da instancia %d\n", node_id, g->id, seg, g->snap_index);
+    }
+}
+
+// guarda a instancia decidida no fim do seu segmento, sem alocacao por entrada
+// uma queda no meio deixa no maximo uma entrada sem indice, que a proxima gravacao sobrescreve
+void store_append(int node_id, paxos_group *g, int slot, log_entry *e) {
+    int seg = (slot - 1) / SEG_SLOTS;
+    if (seg >= g->seg_first + SEG_MAX) store_compact(node_id, g); // snapshot recebido pelo catch-up ainda nao compactado
+    // so fica sem segmento se o snapshot forcado por SNAPSHOT_FORCE nao saiu a tempo (disco falhando, por exemplo):
+    // espera a thread snapshotter em vez de derrubar o node
+    for (int avisou = 0; seg >= g->seg_first + SEG_MAX; avisou = 1) {
+        if (!avisou) printf("[Node %d] grupo %d: sem segmento livre para a instancia %d, esperando o snapshot\n", node_id, g->id, slot);
+        usleep(SNAPSHOT_CHECK_MS * 1000);
+        store_compact(node_id, g);
+    }
+    if (seg < g->seg_first) return; // ja coberta pelo snapshot
+    log_segment *sg = store_segment(node_id, g, seg, 1);
+    uint32_t *idx = (uint32_t *)sg->base;
+    if (idx[(slot - 1) % SEG_SLOTS] != 0) return;
+    store_entry *d = (store_entry *)(sg->base + sg->used);
+    d->slot = slot;
+    d->nvals = e->nvals;
+    memcpy(d->vals, e->vals, sizeof(int32_t) * e->nvals);
+    idx[(slot - 1) % SEG_SLOTS] = sg->used;
+    sg->used += sizeof(store_entry) + sizeof(int32_t) * e->nvals;
+    sg->last = slot;
+}
+
+// reabre os segmentos do grupo e retoma do fim do log decidido: commit_index e estado aplicado
+// segmentos anteriores a seg_first ja estao cobertos pelo snapshot e nao sao abertos;
+// o que veio depois do snapshot e reaplicado na maquina de estados
+void store_open(int node_id, paxos_group *g) {
+    int ultima = 0;
+    log_segment *sg;
+    for (int seg = g->seg_first; (sg = store_segment(node_id, g, seg, 0)) != NULL; seg++) {
+        if (sg->last > ultima) ultima = sg->last;
+    }
+    if (ultima <= g->applied_index) return;
+    g->commit_index = g->decided_sent = g->frontier_slot = ultima;
+    if (g->last_slot < ultima) g->last_slot = ultima;
+    for (int slot = g->applied_index + 1; slot <= ultima; slot++) {
+        const store_entry *e = store_get(g, slot);
+        if (e) sm_apply_batch(g, e->vals, e->nvals, NULL);
+    }
+    g->applied_index = ultima;
+    printf("[Node %d] grupo %d: log decidido retomado ate a instancia %d (%ld comandos reaplicados)\n", node_id, g->id, ultima, g->applied_cmds);
+}
+
+// forca para o disco os segmentos com instancias depois do snapshot ate upto
+// roda fora da thread paxos: com store_mtx a compactacao nao desmapeia nem troca os segmentos no meio
+void store_sync(paxos_group *g, int upto) {
+    pthread_mutex_lock(&g->store_mtx);
+    for (int seg = g->snap_index / SEG_SLOTS; seg <= (upto - 1) / SEG_SLOTS; seg++) {
+        log_segment *sg = store_seg(g, seg);
+        if (sg && sg->base) msync(sg->base, SEG_BYTES, MS_SYNC);
+    }
+    pthread_mutex_unlock(&g->store_mtx);
+}
+
+// arquivo do snapshot do grupo
+void snap_path(char *buf, size_t sz, int node_id, int group, const char *ext) {
+    char *dir = getenv("PAXOS_WAL_DIR");
+    snprintf(buf, sz, "%s/paxos_snap_%d_%d.%s", dir ? dir : ".", node_id, group, ext);
+}
+
+// checksum do snapshot: cabecalho sem o proprio campo e depois as palavras
+uint32_t snap_sum(const snapshot_header *h, const int32_t *words) {
+    return fnv1a_more(fnv1a(&h->group, sizeof(*h) - sizeof(h->sum)), words, sizeof(int32_t) * h->nwords);
+}
+
+// grava o snapshot num arquivo temporario e troca pelo rename: quem le ve o snapshot antigo ou o novo inteiro
+int snap_write(int node_id, int group, int index, const int32_t *words, int nwords) {
+    char tmp[256], path[256];
+    snap_path(tmp, sizeof(tmp), node_id, group, "tmp");
+    snap_path(path, sizeof(path), node_id, group, "dat");
+    snapshot_header h = { 0, group, index, nwords };
+    h.sum = snap_sum(&h, words);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    size_t tam = sizeof(int32_t) * nwords;
+    int r = write(fd, &h, sizeof(h)) == (ssize_t)sizeof(h) && write(fd, words, tam) == (ssize_t)tam ? 0 : -1;
+    if (r == 0 && fdatasync(fd) < 0) r = -1;
+    close(fd);
+    if (r == 0 && rename(tmp, path) < 0) r = -1;
+    if (r < 0) {
+        printf("[Node %d] falha ao gravar o snapshot %s: %s\n", node_id, path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    sync_dir();
+    return 0;
+}
+
+// carrega o snapshot do grupo, se houver, e apaga os segmentos que ele cobre e que sobraram de uma queda
+void snap_open(int node_id, paxos_group *g) {
+    char path[256];
+    snap_path(path, sizeof(path), node_id, g->id, "dat");
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    snapshot_header h;
+    int32_t *words = NULL;
+    int r = read_full(fd, &h, sizeof(h));
+    if (r == 0 && h.nwords >= 0) {
+        words = malloc(sizeof(int32_t) * h.nwords + 1);
+        r = words ? read_full(fd, words, sizeof(int32_t) * h.nwords) : -1;
+    }
+    close(fd);
+    if (r != 0 || !words || h.sum != snap_sum(&h, words) || h.group != g->id || h.index <= 0) {
+        printf("[Node %d] grupo %d: snapshot %s invalido, ignorado\n", node_id, g->id, path);
+        free(words);
+        return;
+    }
+    sm->load(g, words, h.nwords);
+    free(words);
+    g->snap_index = h.index;
+    g->commit_index = g->decided_sent = g->frontier_slot = h.index;
+    if (g->last_slot < h.index) g->last_slot = h.index;
+    g->applied_index = h.index;
+    g->seg_first = h.index / SEG_SLOTS;
+    for (int seg = g->seg_first - 1; seg >= 0; seg--) {
+        store_path(path, sizeof(path), node_id, g->id, seg);
+        if (unlink(path) < 0) break;
+    }
+    printf("[Node %d] grupo %d: snapshot da instancia %d carregado (%d palavras de estado)\n", node_id, g->id, h.index, h.nwords);
+}
+
+// guarda a instancia no log em disco e aplica os comandos dela na maquina de estados,
+// que e o que a leitura pelo lease consulta; res recebe o resultado de cada comando (ou NULL)
+void state_apply(int node_id, paxos_group *g, log_entry *e, int slot, sm_result *res) {
+    store_append(node_id, g, slot, e);
+    pthread_mutex_lock(&g->state_mtx);
+    sm_apply_batch(g, e->vals, e->nvals, res);
+    g->applied_index = slot;
+    pthread_mutex_unlock(&g->state_mtx);
+}
+
+// leitura linearizavel sem rodada de paxos: so o lider com lease valido e com o log do mandato
+// anterior ja aplicado responde; retorna 0 se a leitura tem que ser recusada
+int lease_read(int node_id, paxos_group *g, int key, sm_result *res, int *slot) {
+    if (node_id != group_leader(g->id)) return 0;
+    pthread_mutex_lock(&g->lease_mtx);
+    int valido = now_ms() < g->lease_until;
+    pthread_mutex_unlock(&g->lease_mtx);
+    if (!valido) return 0;
+    pthread_mutex_lock(&g->state_mtx);
+    int pronto = g->applied_index >= g->read_barrier;
+    sm->read(g, key, res);
+    *slot = g->applied_index;
+    pthread_mutex_unlock(&g->state_mtx);
+    return pronto;
+}
+
+static _Atomic int propostas_recebidas = 0; // para as simulacoes de falha do lider
+
+// conexao de um cliente, atendida pela sua propria thread
+typedef struct client_conn {
+    int node_id;
+    int fd;
+} client_conn;
+
+// responde CLIENT_LEADER com o lider do grupo da chave se nao for este node; retorna 1 se redirecionou
+// no modo mencius qualquer node propoe em qualquer grupo, nada e redirecionado
+int redirect_client(int node_id, int fd, int key) {
+    if (mencius) return 0;
+    int lider = group_leader(group_of(key));
+    if (lider == node_id || lider < 1) return 0;
+    msg red = { CLIENT_LEADER, node_id, 0, lider, 0, group_of(key) };
+    char frame[FRAME_MAX_BYTES];
+    write_full(fd, frame, encode_frame(frame, &red, 1));
+    return 1;
+}
+
+// le as propostas de uma conexao do cliente ate ele fechar e coloca cada uma na fila de propostas do grupo
+// fila cheia: espera ate PROPOSAL_WAIT_MS (backpressure) e depois responde CLIENT_BUSY com o valor recusado
+// chave de um grupo liderado por outro node: responde CLIENT_LEADER com ele e o cliente reenvia para la
+void *client_conn_handler(void *arg) {
+    client_conn cc = *(client_conn *)arg;
+    free(arg);
+    int node_id = cc.node_id;
+    msg m;
+    while (read_frame_msg(cc.fd, &m) == 0) {
+        if ((m.type == CLIENT_READ || m.type == CLIENT_PROPOSE || m.type == CLIENT_KV) &&
+            redirect_client(node_id, cc.fd, m.proposal_val)) continue;
+        paxos_group *g = &grp[group_of(m.proposal_val)];
+        sm_result res;
+        int slot;
+        if (m.type == CLIENT_READ) {
+            // leitura respondida do estado local enquanto o lease vale, sem lease o cliente tenta de novo
+            msg resp = { CLIENT_BUSY, node_id, 0, 0, 0, g->id };
+            if (lease_read(node_id, g, m.proposal_val, &res, &slot)) {
+                resp = (msg){ CLIENT_VALUE, node_id, slot, res.value, 0, g->id };
+                printf("[Node %d] leitura pelo lease: valor %d (instancia %d)\n", node_id, res.value, slot);
+            } else {
+                printf("[Node %d] leitura recusada, sem lease\n", node_id);
+            }
+            char frame[FRAME_MAX_BYTES];
+            write_full(cc.fd, frame, encode_frame(frame, &resp, 1));
+            continue;
+        }
+        if (m.type == CLIENT_KV && m.from_id == KV_GET && lease_read(node_id, g, m.proposal_val, &res, &slot)) {
+            // GET com lease sai do estado local; sem lease vai pelo log como os outros comandos
+            msg resp = { CLIENT_RESULT, node_id, res.status, res.value, m.proposal_val, g->id };
+            printf("[Node %d] leitura pelo lease: chave %d = %d (instancia %d)\n", node_id, m.proposal_val, res.value, slot);
+            char frame[FRAME_MAX_BYTES];
+            write_full(cc.fd, frame, encode_frame(frame, &resp, 1));
+            continue;
+        }
+        if (m.type != sm->request) {
+            if (m.type == CLIENT_PROPOSE || m.type == CLIENT_KV) printf("[Node %d] pedido %d nao vale na maquina de estados %s, ignorado\n", node_id, m.type, sm->name);
+            continue;
+        }
+        if (!enqueue_wait(&g->proposals, &m, PROPOSAL_WAIT_MS)) {
+            printf("[Node %d] fila de propostas cheia, recusando valor %d\n", node_id, m.proposal_val);
+            msg busy = { CLIENT_BUSY, node_id, 0, m.proposal_val, 0, g->id };
+            char frame[FRAME_MAX_BYTES];
+            write_full(cc.fd, frame, encode_frame(frame, &busy, 1));
+            continue;
+        }
+        // recebeu proposta do cliente, o lider pega quando houver espaco na janela
+        printf("[Node %d] Received value %d from client\n", node_id, m.proposal_val);
+        int recebidas = ++propostas_recebidas;
+        if (fail_case == 2 && node_id == leader_id && recebidas == 1) {
+            printf("[Node %d] Simulando falha do líder após 1a proposta\n", node_id);
+            exit(99);
+        }
+        if (fail_case == 4 && node_id == leader_id && recebidas == 2) {
+            printf("[Node %d] Simulando falha do líder após 2a proposta\n", node_id);
+            exit(96);
+        }
+    }
+    close(cc.fd);
+    return NULL;
+}
+
+// thread que escuta conexoes do cliente para receber propostas de valor
+// cada conexao tem sua thread, entao um cliente lento nao segura os outros
+void *client_listener(void *arg) {
+    int node_id = (int)(intptr_t)arg;
+    int port = BASE_PORT + 100 + node_id;
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)); // porta pode estar em TIME_WAIT
+    struct sockaddr_in addr = { .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons(port) };
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("[Node] Erro no bind do client_listener");
+        exit(1);
+    }
+    if (listen(server, SOMAXCONN) < 0) { // rajada de propostas nao pode perder conexao
+        perror("[Node] Erro no listen do client_listener");
+        exit(1);
+    }
+    printf("[Node %d] client_listener escutando na porta %d\n", node_id, port);
+    while (1) {
+        int c = accept(server, NULL, NULL); // aceita conexao do cliente
+        if (c < 0) continue;
+        client_conn *cc = malloc(sizeof(*cc));
+        cc->node_id = node_id;
+        cc->fd = c;
+        pthread_t ht;
+        pthread_create(&ht, NULL, client_conn_handler, cc);
+        pthread_detach(ht);
+    }
+    return NULL;
+}
+
+// alguem mostrou ter aplicado ate upto; o node atrasado pede a quem estiver mais adiante
+void catchup_note(paxos_group *g, int from, int upto) {
+    if (upto <= g->catchup_upto) return;
+    g->catchup_peer = from;
+    g->catchup_upto = upto;
+}
+
+// separa heartbeats (so atualizam o timestamp) das mensagens que vao para a fila
+// qualquer mensagem do lider tambem prova que ele esta vivo
+// heartbeat com rodada de lease vai para a fila (o seguidor responde), LEASE_ACK e contado aqui mesmo
+void collect_msg(msg *m, msg *out, int *n_out) {
+    if (m->group < 0 || m->group >= ngroups) return; // grupo que este node nao roda
+    if (m->from_id >= 1 && m->from_id <= NODES) last_recv_ms[m->from_id] = now_ms();
+    // no modo mencius todo node manda heartbeat, so o do lider conta para o leader_monitor
+    if ((m->type == HEARTBEAT && !mencius) || (m->from_id == leader_id && leader_id > 0)) {
+        last_heartbeat = time(NULL); // atualiza timestamp do heartbeat
+    }
+    if (m->type == HEARTBEAT) catchup_note(&grp[m->group], m->from_id, m->slot); // heartbeat leva o applied_index
+    if (m->type == LEASE_ACK) {
+        lease_on_ack(&grp[m->group], m);
+    } else if (m->type == CATCHUP_REQ) {
+        enqueue(&catchup_q, m);
+    } else if (m->type == ELECTION && election_done) {
+        enqueue(&late_q, m);
+    } else if ((m->type == ELECTION || m->type == COORDINATOR) && !election_done) {
+        enqueue(&election_q, m); // na reeleicao a thread paxos do grupo 0 tambem le a fila dele e descartaria a candidatura
+    } else if (m->type != HEARTBEAT || m->proposal_num > 0) {
+        out[(*n_out)++] = *m;
+    }
+}
+
+// entrega as mensagens recebidas na fila do grupo de cada uma
+void deliver(msg *ms, int n) {
+    atomic_fetch_add_explicit(&msgs_recv, n, memory_order_relaxed);
+    if (ngroups == 1) {
+        enqueue_many(&grp[0].inbox, ms, n);
+        return;
+    }
+    for (int i = 0; i < n; i++) enqueue(&grp[ms[i].group].inbox, &ms[i]);
+}
+
+// extrai os quadros completos de buf, as mensagens vao para out (n_out e atualizado)
+// consumed recebe quantos bytes foram usados
+// retorna 1 se parou porque out nao tem espaco para o proximo envelope, -1 se o fluxo estiver corrompido
+int parse_buf(const char *buf, size_t len, size_t *consumed, msg *out, int max_out, int *n_out) {
+    size_t off = 0;
+    int r = 0;
+    while (off < len) {
+        if ((uint8_t)buf[off] != WIRE_VERSION) return -1; // versao desconhecida
+        uint32_t blen, count;
+        size_t h = get_varint(buf + off + 1, len - off - 1, &blen);
+        if (h == 0) {
+            if (len - off - 1 >= 5) return -1;
+            break; // cabecalho ainda incompleto
+        }
+        if (blen > MAX_FRAME) return -1;
+        if (len - off < 1 + h + blen) break; // quadro ainda incompleto
+        const char *body = buf + off + 1 + h;
+        size_t boff = get_varint(body, blen, &count);
+        if (boff == 0 || count > MAX_BATCH) return -1;
+        if (*n_out + (int)count > max_out) {
+            r = 1;
+            break;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            msg m;
+            size_t k = decode_msg(body + boff, blen - boff, &m);
+            if (k == 0) return -1;
+            boff += k;
+            collect_msg(&m, out, n_out);
+        }
+        off += 1 + h + blen;
+    }
+    *consumed = off;
+    return r;
+}
+
+// extrai os quadros completos do buffer da conexao, guarda o resto para a proxima leitura
+int parse_frames(conn_state *cs, msg *out, int max_out, int *n_out) {
+    size_t off = 0;
+    int r = parse_buf(cs->buf, cs->len, &off, out, max_out, n_out);
+    if (r < 0) return -1;
+    if (off > 0) {
+        memmove(cs->buf, cs->buf + off, cs->len - off);
+        cs->len -= off;
+    }
+    return r;
+}
+
+// le tudo que estiver disponivel na conexao
+// retorna 1 se o lote encheu antes de esvaziar o socket, -1 se a conexao fechou ou quebrou
+int drain_conn(conn_state *cs, msg *out, int max_out, int *n_out) {
+    while (1) {
+        int r = parse_frames(cs, out, max_out, n_out);
+        if (r != 0) return r; // erro, ou lote cheio: chamador entrega e chama de novo
+        ssize_t n = read(cs->fd, cs->buf + cs->len, sizeof(cs->buf) - cs->len);
+        if (n > 0) {
+            cs->len += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1; // eof ou erro
+    }
+}
+
+// abre o socket tcp onde os outros nodes se conectam
+int open_listen_socket(int node_id, int flags) {
+    int server = socket(AF_INET, SOCK_STREAM | flags, 0);
+    struct sockaddr_in sin = { .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons(BASE_PORT + node_id) };
+    int opt = 1;
+    // conexoes persistentes deixam TIME_WAIT na porta do node ao reiniciar
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    bind(server, (struct sockaddr*)&sin, sizeof(sin));
+    listen(server, NODES);
+    return server;
+}
+
+// thread que escuta mensagens tcp de outros nodes
+// um unico epoll atende o socket de escuta e todas as conexoes dos vizinhos
+void *listener(void *arg) {
+    int node_id = (int)(intptr_t)arg;
+    int server = open_listen_socket(node_id, SOCK_NONBLOCK);
+
+    int ep = epoll_create1(0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL }; // ptr NULL = socket de escuta
+    epoll_ctl(ep, EPOLL_CTL_ADD, server, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    msg batch[QUEUE_CAPACITY];
+    while (1) {
+        int n = epoll_wait(ep, events, MAX_EVENTS, -1);
+        if (n < 0) continue;
+        int got = 0;
+        for (int i = 0; i < n; i++) {
+            conn_state *cs = events[i].data.ptr;
+            if (cs == NULL) {
+                // aceita todas as conexoes pendentes de outros nodes
+                int c;
+                while ((c = accept4(server, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    conn_state *ncs = malloc(sizeof(*ncs));
+                    ncs->fd = c;
+                    ncs->len = 0;
+                    struct epoll_event cev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = ncs };
+                    epoll_ctl(ep, EPOLL_CTL_ADD, c, &cev);
+                }
+                continue;
+            }
+            int r;
+            while ((r = drain_conn(cs, batch, QUEUE_CAPACITY, &got)) == 1) {
+                deliver(batch, got);
+                got = 0;
+            }
+            if (r < 0) {
+                // node vizinho fechou a conexao
+                epoll_ctl(ep, EPOLL_CTL_DEL, cs->fd, NULL);
+                close(cs->fd);
+                free(cs);
+            }
+        }
+        // entrega de uma vez tudo que chegou nesta volta
+        if (got > 0) deliver(batch, got);
+    }
+    return NULL;
+}
+
+// devolve buffers ao grupo usado pelo recv multishot
+void uring_provide(int bid, int count) {
+    struct io_uring_sqe *sqe = uring_sqe(&rx_ring);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uintptr_t)rx_bufs[bid];
+    sqe->len = URING_BUF_SIZE;
+    sqe->off = bid;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = UR_PROVIDE;
+}
+
+void uring_arm_accept(int server) {
+    struct io_uring_sqe *sqe = uring_sqe(&rx_ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UR_ACCEPT;
+}
+
+// junta um buffer do recv ao quadro incompleto da conexao, aos pedacos que cabem em cs->buf, e entrega
+// os quadros completos; retorna -1 se o fluxo esta corrompido (ou quadro maior que o buffer)
+int uring_reassemble(conn_state *cs, const char *data, size_t n, msg *batch, int *got) {
+    size_t off = 0;
+    while (off < n) {
+        size_t cabe = sizeof(cs->buf) - cs->len;
+        if (cabe == 0) return -1;
+        if (cabe > n - off) cabe = n - off;
+        memcpy(cs->buf + cs->len, data + off, cabe);
+        cs->len += cabe;
+        off += cabe;
+        int r;
+        while ((r = parse_frames(cs, batch, QUEUE_CAPACITY, got)) == 1) {
+            deliver(batch, *got);
+            *got = 0;
+        }
+        if (r < 0) return -1;
+    }
+    return 0;
+}
+
+// recv multishot: uma submissao entrega todas as leituras da conexao ate ela fechar
+void uring_arm_recv(conn_state *cs) {
+    struct io_uring_sqe *sqe = uring_sqe(&rx_ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = cs->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = (uintptr_t)cs;
+}
+
+// thread que recebe mensagens tcp dos outros nodes pelo io_uring
+// accept e recv multishot ficam armados no kernel; cada volta e uma unica syscall
+// que submete o que estiver pendente e espera conclusoes
+void *uring_listener(void *arg) {
+    int node_id = (int)(intptr_t)arg;
+    int server = open_listen_socket(node_id, 0);
+    uring_provide(0, URING_BUFS);
+    uring_arm_accept(server);
+    msg batch[QUEUE_CAPACITY];
+    while (1) {
+        if (uring_enter(&rx_ring, 1) < 0) continue;
+        int got = 0;
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek(&rx_ring))) {
+            uint64_t ud = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&rx_ring);
+            if (ud == UR_PROVIDE) continue;
+            if (ud == UR_ACCEPT) {
+                if (res >= 0) {
+                    conn_state *cs = malloc(sizeof(*cs));
+                    cs->fd = res;
+                    cs->len = 0;
+                    cs->dead = 0;
+                    uring_arm_recv(cs);
+                }
+                if (!(flags & IORING_CQE_F_MORE)) uring_arm_accept(server);
+                continue;
+            }
+            conn_state *cs = (conn_state *)(uintptr_t)ud;
+            if (res > 0) {
+                int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                if (!cs->dead && uring_reassemble(cs, rx_bufs[bid], res, batch, &got) < 0) {
+                    // fluxo corrompido ou de outra versao do fio: descarta o que sobrou e derruba a conexao;
+                    // conclusoes ja enfileiradas do recv ainda apontam para cs, que so sai na ultima
+                    cs->len = 0;
+                    cs->dead = 1;
+                    shutdown(cs->fd, SHUT_RDWR);
+                }
+                uring_provide(bid, 1);
+            }
+            if (flags & IORING_CQE_F_MORE) continue;
+            // ultima conclusao deste recv
+            if (!cs->dead && (res > 0 || res == -ENOBUFS)) {
+                uring_arm_recv(cs); // ENOBUFS: buffers voltam com os provide desta volta
+            } else {
+                close(cs->fd); // node vizinho fechou a conexao, ou fluxo corrompido
+                free(cs);
+            }
+        }
+        if (got > 0) deliver(batch, got);
+    }
+    return NULL;
+}
+
+// thread que recebe os datagramas dos outros nodes no transporte udp
+// recvmmsg traz varios datagramas por chamada e tudo entra na fila de uma vez
+void *udp_listener(void *arg) {
+    (void)arg;
+    static char bufs[MAX_EVENTS][MAX_DGRAM];
+    struct mmsghdr mm[MAX_EVENTS];
+    struct iovec iov[MAX_EVENTS];
+    msg batch[QUEUE_CAPACITY];
+    while (1) {
+        for (int i = 0; i < MAX_EVENTS; i++) {
+            iov[i].iov_base = bufs[i];
+            iov[i].iov_len = MAX_DGRAM;
+            memset(&mm[i], 0, sizeof(mm[i]));
+            mm[i].msg_hdr.msg_iov = &iov[i];
+            mm[i].msg_hdr.msg_iovlen = 1;
+        }
+        // bloqueia ate o primeiro datagrama e pega os que ja estiverem na fila do socket
+        int n = recvmmsg(udp_sock, mm, MAX_EVENTS, MSG_WAITFORONE, NULL);
+        if (n <= 0) continue;
+        int got = 0;
+        for (int i = 0; i < n; i++) {
+            size_t off = 0, used;
+            // datagrama com versao desconhecida ou truncado e descartado no que sobrou
+            while (parse_buf(bufs[i] + off, mm[i].msg_len - off, &used, batch, QUEUE_CAPACITY, &got) == 1) {
+                off += used;
+                deliver(batch, got);
+                got = 0;
+            }
+        }
+        if (got > 0) deliver(batch, got);
+    }
+    return NULL;
+}
+
+// abre o socket udp do node na mesma porta numerica do listener tcp
+void udp_init(int node_id) {
+    udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in sin = { .sin_family = AF_INET,
+        .sin_addr.s_addr = INADDR_ANY,
+        .sin_port = htons(BASE_PORT + node_id) };
+    if (bind(udp_sock, (struct sockaddr*)&sin, sizeof(sin)) < 0) {
+        perror("[Node] Erro no bind do socket udp");
+        exit(1);
+    }
+}
+
+// esvazia todos os aneis que chegam em node_id, retorna quantas mensagens foram lidas
+int shm_drain(int node_id, msg *batch, int *got) {
+    int lidas = 0;
+    for (int src = 1; src <= NODES; src++) {
+        if (src == node_id) continue;
+        shm_ring *r = &shm->rings[src][node_id];
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        while (head != tail) {
+            if (*got >= QUEUE_CAPACITY) {
+                deliver(batch, *got);
+                *got = 0;
+            }
+            msg m = r->slots[head & (SHM_RING_SLOTS - 1)];
+            head++;
+            lidas++;
+            collect_msg(&m, batch, got);
+        }
+        atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+    return lidas;
+}
+
+// thread que recebe mensagens pelos aneis em memoria compartilhada
+// dorme no futex do proprio doorbell quando todos os aneis estao vazios
+void *shm_listener(void *arg) {
+    int node_id = (int)(intptr_t)arg;
+    msg batch[QUEUE_CAPACITY];
+    while (1) {
+        int got = 0;
+        uint32_t seq = atomic_load(&shm->doorbell[node_id]);
+        if (shm_drain(node_id, batch, &got) == 0) {
+            // anuncia que vai dormir e confere de novo antes de esperar
+            atomic_store(&shm->waiting[node_id], 1);
+            if (shm_drain(node_id, batch, &got) == 0) {
+                futex(&shm->doorbell[node_id], FUTEX_WAIT, seq); // volta na hora se o doorbell mudou
+            }
+            atomic_store(&shm->waiting[node_id], 0);
+        }
+        if (got > 0) deliver(batch, got);
+    }
+    return NULL;
+}
+
+// abre (ou cria) o segmento compartilhado
+// mensagens escritas antes do destino subir ficam no anel ate ele ler (o main.c apaga o segmento a cada execucao)
+void shm_init(void) {
+    int fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, sizeof(shm_area)) < 0) {
+        perror("[Node] Erro ao abrir memoria compartilhada");
+        exit(1);
+    }
+    shm = mmap(NULL, sizeof(shm_area), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("[Node] Erro no mmap da memoria compartilhada");
+        exit(1);
+    }
+}
+
+// candidaturas que a eleicao ainda espera; passado ELECTION_TIMEOUT (prazo) vizinho fora do ar pelo breaker
+// nao conta mais, senao com um node parado a reeleicao esperaria para sempre
+int election_missing(int node_id, const int *seen, int prazo) {
+    int faltam = 0;
+    for (int i = 1; i <= NODES; i++) {
+        if (i != node_id && !seen[i] && !(prazo && peer_health(i) == PEER_DOWN)) faltam++;
+    }
+    return faltam;
+}
+
+// thread responsavel por executar a eleicao de lider entre os nodes
+void *election(void *arg) {
+    int node_id = (int)(intptr_t)arg; 
+    srand(time(NULL) + node_id);
+    int my_num = rand() % 10000; // num aleatorio para eleicao
+    msg m = { ELECTION, node_id, 0, my_num, 0, 0 };
+    // envia mensagem de candidatura para todos os outros nodes
+    broadcast_msg(node_id, &m);
+
+    int best_num = my_num, best_id = node_id;
+    int seen[NODES + 1] = {0}; // candidaturas repetidas (reenvio udp) contam uma vez so
+    // coleta candidaturas dos outros nodes
+    long enviada = now_ms(), inicio = enviada;
+    while (election_missing(node_id, seen, now_ms() - inicio >= ELECTION_TIMEOUT * 1000) > 0) {
+        msg r;
+        if (!dequeue_timeout(&election_q, &r, RETRANSMIT_MS)) {
+            // datagrama pode ter se perdido; na fila congestionada a candidatura ainda esta la. Vizinho fora do
+            // ar tambem recebe: sem resposta aos reenvios o disjuntor do udp o da como PEER_DOWN
+            if (transport == TRANSPORT_UDP) {
+                int targets[NODES], n = 0;
+                for (int i = 1; i <= NODES; i++) if (i != node_id && !peer_congested(i)) targets[n++] = i;
+                if (n > 0) send_to_peers(targets, n, &m);
+            }
+            // node que voltou depois da eleicao: a candidatura pode ter saido antes das conexoes, o lider responde a repetida
+            if (transport != TRANSPORT_UDP && now_ms() - enviada >= ELECTION_TIMEOUT * 1000) {
+                broadcast_msg(node_id, &m);
+                enviada = now_ms();
+            }
+            continue;
+        }
+        if (r.type == ELECTION && !seen[r.from_id]) {
+            seen[r.from_id] = 1;
+            // atualiza o melhor candidato
+            if (r.proposal_val > best_num || (r.proposal_val == best_num && r.from_id > best_id)) {
+                best_num = r.proposal_val;
+                best_id = r.from_id;
+            }
+        } else if (r.type == COORDINATOR) {
+            // outro node ja viu todas as candidaturas e anunciou o vencedor
+            best_id = r.proposal_val;
+            break;
+        }
+    }
+    leader_id = best_id; // define o lider eleito
+    for (int i = 0; i < ngroups; i++) grp[i].leader_ballot = 0; // mandato novo, os lideres refazem a fase 1
+    msg coord = { COORDINATOR, node_id, 0, best_id, 0, 0 };
+    // informa todos os nodes sobre o lider eleito
+    if (broadcast_msg(node_id, &coord) == SEND_DROPPED)
+        printf("[Node %d] fila de saida cheia, mensagens antigas descartadas\n", node_id);
+    char buf[128], ts[32];
+    timestamp(ts, sizeof(ts));
+    snprintf(buf, sizeof(buf), "%s,%d,all,ELECT,%d,%d\n", ts, node_id, my_num, best_id);
+    send_monitor(buf); // loga eleicao
+    election_done = 1;
+    printf("[Node %d] Leader elected: %d\n", node_id, leader_id);
+    if (node_id == leader_id) {
+        // se for o lider informa o cliente (todo node ja escuta propostas, ver main)
+        // na reeleicao o cliente so volta a ouvir a porta depois do proprio timeout, entao tenta de novo ate ele aceitar
+        sleep(1);
+        for (int t = 0; t < INFORM_TRIES && node_id == leader_id && inform_client(leader_id) < 0; t++) sleep(1);
+    }
+    return NULL;
+}
+
+// entrada do log para a instancia slot (o anel reaproveita a posicao de instancias antigas)
+log_entry *log_at(paxos_group *g, int slot) {
+    log_entry *e = &g->rlog[slot % LOG_CAPACITY];
+    if (e->slot != slot) memset(e, 0, sizeof(*e));
+    e->slot = slot;
+    return e;
+}
+
+// a instancia slot ainda esta no anel?
+int log_has(paxos_group *g, int slot) {
+    return slot > 0 && g->rlog[slot % LOG_CAPACITY].slot == slot;
+}
+
+// modo mencius: dono da instancia, as instancias giram entre os nodes (1, 2, ..., NODES, 1, ...)
+int owner_of(int slot) {
+    return (slot - 1) % NODES + 1;
+}
+
+// monta um registro do WAL em rec e retorna o tamanho
+size_t wal_encode(char *rec, int type, int group, int ballot, int slot, int n, const int *vals) {
+    int nv = type == WAL_ACCEPT ? n : 0;
+    wal_header h = { 0, type, group, ballot, slot, n };
+    memcpy(rec, &h, sizeof(h));
+    if (nv > 0) memcpy(rec + sizeof(h), vals, sizeof(int) * nv);
+    size_t len = sizeof(h) + sizeof(int) * nv;
+    h.sum = fnv1a(rec + sizeof(h.sum), len - sizeof(h.sum));
+    memcpy(rec, &h.sum, sizeof(h.sum));
+    return len;
+}
+
+// acrescenta um registro ao WAL sem esperar a gravacao; quem depende dele espera com wal_wait(g->wal_lsn)
+void wal_append(paxos_group *g, int type, int ballot, int slot, int n, const int *vals) {
+    if (wal_sync == WAL_OFF) return;
+    char rec[sizeof(wal_header) + sizeof(int) * ENTRY_MAX_VALUES];
+    size_t len = wal_encode(rec, type, g->id, ballot, slot, n, vals);
+    pthread_mutex_lock(&wal.mtx);
+    while (wal.len + len > WAL_BUF_SIZE) { // buffer cheio: espera o flusher esvaziar
+        wal.want = 1;
+        pthread_cond_signal(&wal.flush);
+        pthread_cond_wait(&wal.durable, &wal.mtx);
+    }
+    memcpy(wal.buf + wal.len, rec, len);
+    wal.len += len;
+    wal.appended_lsn += len;
+    g->wal_lsn = wal.appended_lsn;
+    pthread_mutex_unlock(&wal.mtx);
+}
+
+// espera o WAL gravar ate lsn; quem chega enquanto o flusher escreve entra na proxima gravacao
+void wal_wait(long lsn) {
+    if (wal_sync == WAL_OFF) return;
+    pthread_mutex_lock(&wal.mtx);
+    while (wal.durable_lsn < lsn) {
+        wal.want = 1;
+        pthread_cond_signal(&wal.flush);
+        pthread_cond_wait(&wal.durable, &wal.mtx);
+    }
+    pthread_mutex_unlock(&wal.mtx);
+}
+
+// escreve n bytes no arquivo do WAL e sincroniza conforme a politica
+void wal_write(int node_id, int fd, const char *b, size_t n) {
+    for (size_t off = 0; off < n; ) {
+        ssize_t w = write(fd, b + off, n - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0) {
+            // sem o WAL o acceptor nao pode prometer nada, melhor parar
+            printf("[Node %d] falha ao gravar o WAL: %s\n", node_id, strerror(errno));
+            exit(1);
+        }
+        off += w;
+    }
+    if (wal_sync == WAL_FSYNC && fdatasync(fd) < 0) {
+        printf("[Node %d] falha no fsync do WAL: %s\n", node_id, strerror(errno));
+        exit(1);
+    }
+}
+
+// thread que grava o WAL: so escreve quando alguem espera, entao os registros de um lote inteiro
+// de mensagens (e dos outros grupos) vao numa escrita e num fsync
+void *wal_flusher(void *arg) {
+    int node_id = (int)(intptr_t)arg;
+    char *livre = malloc(WAL_BUF_SIZE);
+    pthread_mutex_lock(&wal.mtx);
+    while (1) {
+        while (!wal.want || wal.len == 0) pthread_cond_wait(&wal.flush, &wal.mtx);
+        wal.want = 0;
+        char *b = wal.buf;
+        size_t n = wal.len;
+        long lsn = wal.appended_lsn;
+        int troca = wal.next_fd;
+        long corte = wal.rotate_lsn;
+        wal.buf = livre;
+        wal.len = 0;
+        pthread_mutex_unlock(&wal.mtx);
+        // rotacao pendente que cai neste trecho: o que vem antes do corte fecha a geracao atual
+        size_t antes = n;
+        if (troca >= 0 && corte < lsn) antes = corte > lsn - (long)n ? (size_t)(corte - (lsn - (long)n)) : 0;
+        if (antes > 0) wal_write(node_id, wal.fd, b, antes);
+        if (antes < n) {
+            close(wal.fd);
+            wal.fd = troca;
+            wal_write(node_id, wal.fd, b + antes, n - antes);
+        }
+        livre = b;
+        pthread_mutex_lock(&wal.mtx);
+        if (antes < n) {
+            wal.gen++;
+            wal.next_fd = -1;
+        }
+        wal.durable_lsn = lsn;
+        pthread_cond_broadcast(&wal.durable);
+    }
+    return NULL;
+}
+
+// grava os registros do grupo (um fsync para todos) e solta as respostas guardadas
+void wal_release(int node_id, paxos_group *g) {
+    if (g->nheld == 0) return;
+    wal_wait(g->wal_lsn);
+    for (int i = 0; i < g->nheld; i++) {
+        if (g->held_to[i] == 0) broadcast_msg(node_id, &g->held[i]);
+        else send_msg(g->held_to[i], &g->held[i]);
+    }
+    g->nheld = 0;
+}
+
+// resposta do acceptor que depende de estado ainda nao gravado: guardada ate o proximo wal_release
+void hold_msg(int node_id, paxos_group *g, int target, msg *m) {
+    if (wal_sync == WAL_OFF) {
+        if (target == 0) broadcast_msg(node_id, m);
+        else send_msg(target, m);
+        return;
+    }
+    if (g->nheld == HELD_MAX) wal_release(node_id, g);
+    g->held[g->nheld] = *m;
+    g->held_to[g->nheld++] = target;
+}
+
+// refaz no grupo o estado do acceptor de um registro do WAL
+void wal_replay(paxos_group *g, wal_header *h, const int *vals) {
+    if (h->ballot > g->highest_proposal) g->highest_proposal = h->ballot;
+    // aceitar no multi-paxos tambem e prometer (fora do modo mencius, onde a promessa e por dono)
+    if ((h->type == WAL_PROMISE || (h->type == WAL_ACCEPT && !mencius)) && h->ballot > g->promised_num) {
+        g->promised_num = h->ballot;
+    }
+    if (h->type == WAL_ACCEPT) {
+        log_entry *e = log_at(g, h->slot);
+        e->ballot = h->ballot;
+        e->nvals = h->n;
+        memcpy(e->vals, vals, sizeof(int) * h->n);
+        if (h->slot > g->last_slot) g->last_slot = h->slot;
+    } else if (h->type == WAL_OWNER) {
+        int o = owner_of(h->slot);
+        g->owner_promise[o] = h->ballot;
+        g->owner_from[o] = h->slot;
+        g->owner_to[o] = h->n;
+    }
+}
+
+// arquivo da geracao gen do WAL do node
+void wal_path(char *buf, size_t sz, int node_id, int gen) {
+    char *dir = getenv("PAXOS_WAL_DIR");
+    snprintf(buf, sz, "%s/paxos_wal_%d_%d.log", dir ? dir : ".", node_id, gen);
+}
+
+// refaz os registros validos de um arquivo do WAL e retorna onde eles terminam
+long wal_replay_file(int fd, int *lidos) {
+    long pos = 0;
+    wal_header h;
+    int vals[ENTRY_MAX_VALUES];
+    while (read_full(fd, &h, sizeof(h)) == 0) {
+        int nv = h.type == WAL_ACCEPT ? h.n : 0;
+        if (nv < 0 || nv > ENTRY_MAX_VALUES || h.group < 0 || h.group >= MAX_GROUPS) break;
+        if (nv > 0 && read_full(fd, vals, sizeof(int) * nv) != 0) break;
+        char rec[sizeof(wal_header) + sizeof(int) * ENTRY_MAX_VALUES];
+        size_t len = wal_encode(rec, h.type, h.group, h.ballot, h.slot, h.n, vals);
+        if (memcmp(rec, &h.sum, sizeof(h.sum)) != 0) break;
+        if (h.group < ngroups) wal_replay(&grp[h.group], &h, vals);
+        pos += len;
+        (*lidos)++;
+    }
+    return pos;
+}
+
+// abre o WAL do node e refaz o estado dos acceptors, da geracao mais antiga para a mais nova
+// o fim que ficou pela metade numa queda e cortado e a escrita continua na geracao mais nova
+void wal_open(int node_id) {
+    if (wal_sync == WAL_OFF) return;
+    char path[256], pattern[256];
+    char *dir = getenv("PAXOS_WAL_DIR");
+    snprintf(pattern, sizeof(pattern), "%s/paxos_wal_%d_*.log", dir ? dir : ".", node_id);
+    glob_t gl;
+    int menor = 0, maior = 0;
+    if (glob(pattern, 0, NULL, &gl) == 0) {
+        for (size_t i = 0; i < gl.gl_pathc; i++) {
+            const char *nome = strrchr(gl.gl_pathv[i], '_') + 1;
+            int gen = atoi(nome);
+            if (i == 0 || gen < menor) menor = gen;
+            if (i == 0 || gen > maior) maior = gen;
+        }
+        globfree(&gl);
+    }
+    wal.buf = malloc(WAL_BUF_SIZE);
+    wal.oldest_gen = menor;
+    wal.gen = maior;
+    int lidos = 0;
+    for (int gen = menor; gen <= maior; gen++) {
+        wal_path(path, sizeof(path), node_id, gen);
+        int fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            printf("[Node %d] falha ao abrir o WAL %s: %s\n", node_id, path, strerror(errno));
+            exit(1);
+        }
+        long pos = wal_replay_file(fd, &lidos);
+        if (gen < maior) {
+            close(fd);
+            continue;
+        }
+        if (ftruncate(fd, pos) < 0 || lseek(fd, pos, SEEK_SET) < 0) {
+            printf("[Node %d] falha ao preparar o WAL %s: %s\n", node_id, path, strerror(errno));
+            exit(1);
+        }
+        wal.fd = fd;
+    }
+    if (lidos > 0) printf("[Node %d] WAL: %d registros recuperados (geracoes %d a %d)\n", node_id, lidos, menor, maior);
+}
+
+// abre a proxima geracao do WAL; os registros acrescentados a partir de agora vao para ela
+// e cada grupo regrava ali o que o acceptor precisa lembrar (wal_checkpoint)
+void wal_rotate(int node_id) {
+    if (wal_sync == WAL_OFF) return;
+    pthread_mutex_lock(&wal.mtx);
+    if (wal.next_fd >= 0) { // troca anterior ainda nao aconteceu
+        pthread_mutex_unlock(&wal.mtx);
+        return;
+    }
+    char path[256];
+    wal_path(path, sizeof(path), node_id, wal.gen + 1);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        printf("[Node %d] falha ao abrir o WAL %s: %s\n", node_id, path, strerror(errno));
+        pthread_mutex_unlock(&wal.mtx);
+        return;
+    }
+    wal.next_fd = fd;
+    wal.rotate_lsn = wal.appended_lsn;
+    for (int i = 0; i < ngroups; i++) grp[i].wal_checkpoint = 1;
+    pthread_mutex_unlock(&wal.mtx);
+    sync_dir();
+}
+
+// rotacao pedida: grava no WAL (ja na geracao nova) o que o acceptor do grupo ainda precisa lembrar,
+// promessas e lotes aceitos ainda nao aplicados; o que ja foi aplicado esta no log em disco
+void wal_checkpoint(paxos_group *g) {
+    if (!g->wal_checkpoint) return;
+    if (g->promised_num > 0) wal_append(g, WAL_PROMISE, g->promised_num, 0, 0, NULL);
+    for (int o = 1; o <= NODES; o++) {
+        if (g->owner_promise[o] > 0) wal_append(g, WAL_OWNER, g->owner_promise[o], g->owner_from[o], g->owner_to[o], NULL);
+    }
+    for (int slot = g->applied_index + 1; slot <= g->last_slot; slot++) {
+        if (!log_has(g, slot)) continue;
+        log_entry *e = &g->rlog[slot % LOG_CAPACITY];
+        if (e->ballot > 0) wal_append(g, WAL_ACCEPT, e->ballot, slot, e->nvals, e->vals);
+    }
+    g->checkpoint_applied = g->applied_index;
+    g->checkpoint_lsn = g->wal_lsn;
+    g->wal_checkpoint = 0; // depois do lsn: quem ve o pedido atendido ja ve o fim do checkpoint
+}
+
+// apaga as geracoes antigas do WAL quando a troca ja aconteceu e o checkpoint de todo grupo esta gravado
+void wal_retire(int node_id) {
+    if (wal_sync == WAL_OFF) return;
+    long precisa = 0;
+    for (int i = 0; i < ngroups; i++) {
+        if (grp[i].wal_checkpoint) return;
+        if (grp[i].checkpoint_lsn > precisa) precisa = grp[i].checkpoint_lsn;
+    }
+    wal_wait(precisa);
+    // o que o checkpoint deixou de fora por ja estar aplicado so fica seguro no disco depois do msync
+    for (int i = 0; i < ngroups; i++) store_sync(&grp[i], grp[i].checkpoint_applied);
+    pthread_mutex_lock(&wal.mtx);
+    int ate = wal.next_fd < 0 ? wal.gen : wal.oldest_gen;
+    pthread_mutex_unlock(&wal.mtx);
+    if (wal.oldest_gen >= ate) return;
+    char path[256];
+    for (int gen = wal.oldest_gen; gen < ate; gen++) {
+        wal_path(path, sizeof(path), node_id, gen);
+        unlink(path);
+    }
+    wal.oldest_gen = ate;
+    sync_dir();
+}
+
+// ACCEPT_VALUE e PROMISE_VALUE levam a proposta e a posicao do valor no lote no mesmo campo
+int pack_pos(int ballot, int idx) {
+    return ballot * ENTRY_MAX_VALUES + idx;
+}
+
+// guarda um valor de lote que ainda nao fechou; proposta nova descarta o que veio antes
+void stage_value(log_entry *e, int packed, int val) {
+    int ballot = packed / ENTRY_MAX_VALUES, idx = packed % ENTRY_MAX_VALUES;
+    if (e->stage_ballot != ballot) {
+        e->stage_ballot = ballot;
+        e->stage_mask = 0;
+    }
+    e->stage_vals[idx] = val;
+    e->stage_mask |= 1u << idx;
+}
+
+// o lote da proposta ballot com n valores chegou inteiro? lote vazio nao tem valor a esperar
+int stage_complete(log_entry *e, int ballot, int n) {
+    return n >= 0 && n <= ENTRY_MAX_VALUES && (n == 0 || e->stage_ballot == ballot) &&
+           (e->stage_mask & ((1u << n) - 1)) == (1u << n) - 1;
+}
+
+// avisa os seguidores ate onde o log esta decidido (DECIDED com a proposta do mandato e o commit_index)
+void send_decided(int node_id, paxos_group *g) {
+    msg d = { DECIDED, node_id, g->leader_ballot, g->commit_index, 0, g->id };
+    broadcast_msg(node_id, &d);
+    g->decided_sent = g->commit_index;
+}
+
+// modo thrifty: os q2 - 1 vizinhos no ar de menor rtt, que com o lider fecham o quorum da fase 2
+// vizinho que ficou de fora tem o rtt reduzido a cada THRIFTY_PROBE_MS, entao volta a ser testado
+int fastest_peers(int node_id, paxos_group *g, int *targets) {
+    int n = 0;
+    for (int i = 1; i <= NODES; i++) {
+        if (i != node_id && peer_health(i) != PEER_DOWN && !peer_congested(i)) targets[n++] = i;
+    }
+    for (int a = 1; a < n; a++) {
+        for (int b = a; b > 0 && g->peer_rtt_us[targets[b]] < g->peer_rtt_us[targets[b - 1]]; b--) {
+            int t = targets[b];
+            targets[b] = targets[b - 1];
+            targets[b - 1] = t;
+        }
+    }
+    long agora = now_ms();
+    if (agora - g->rtt_decay_ms >= THRIFTY_PROBE_MS) {
+        for (int k = q2 - 1; k < n; k++) g->peer_rtt_us[targets[k]] /= 2;
+        g->rtt_decay_ms = agora;
+    }
+    return n < q2 - 1 ? n : q2 - 1;
+}
+
+// manda o lote da entrada para targets: os valores e depois o ACCEPT que fecha o lote
+void send_batch_to(int node_id, paxos_group *g, log_entry *e, const int *targets, int n) {
+    if (n == 0) return;
+    for (int i = 0; i < e->nvals; i++) {
+        msg v = { ACCEPT_VALUE, node_id, pack_pos(e->ballot, i), e->vals[i], e->slot, g->id };
+        send_to_peers(targets, n, &v);
+    }
+    msg acc = { ACCEPT, node_id, e->ballot, e->nvals, e->slot, g->id };
+    send_to_peers(targets, n, &acc);
+    long agora = now_us();
+    for (int k = 0; k < n; k++) {
+        e->sent_to[targets[k]] = 1;
+        e->sent_us[targets[k]] = agora;
+    }
+}
+
+// primeiro envio do lote vai para todos, ou no modo thrifty so para o quorum mais rapido;
+// reenvio vai para quem ja recebeu e nao respondeu
+// se houver decisao nova ela vai junto, no mesmo envelope do ACCEPT
+void send_accept(int node_id, paxos_group *g, log_entry *e) {
+    int targets[NODES], n = 0, primeiro = 1;
+    for (int i = 1; i <= NODES; i++) {
+        if (e->sent_to[i]) primeiro = 0;
+    }
+    if (primeiro && thrifty) {
+        n = fastest_peers(node_id, g, targets);
+        // o mais lento dos escolhidos define quanto esperar antes de chamar os demais
+        long espera = 0;
+        for (int k = 0; k < n; k++) {
+            if (g->peer_rtt_us[targets[k]] > espera) espera = g->peer_rtt_us[targets[k]];
+        }
+        espera = 2 * espera / 1000;
+        e->fallback_ms = now_ms() + (espera > THRIFTY_MIN_MS ? espera : THRIFTY_MIN_MS);
+    } else {
+        for (int i = 1; i <= NODES; i++) {
+            if (i != node_id && (primeiro || (e->sent_to[i] && !e->acked[i]))) targets[n++] = i;
+        }
+    }
+    send_batch_to(node_id, g, e, targets, n);
+    if (!mencius && g->decided_sent < g->commit_index) send_decided(node_id, g);
+    e->sent_ms = now_ms();
+}
+
+// modo thrifty: o quorum escolhido nao respondeu a tempo, o lote vai para os vizinhos que ficaram de fora
+// quem foi escolhido e nao respondeu tem o rtt dobrado, e no minimo o tempo ja esperado
+void send_accept_rest(int node_id, paxos_group *g, log_entry *e) {
+    int targets[NODES], n = 0;
+    long agora = now_us();
+    for (int i = 1; i <= NODES; i++) {
+        if (i == node_id) continue;
+        if (!e->sent_to[i]) targets[n++] = i;
+        else if (!e->acked[i]) {
+            g->peer_rtt_us[i] *= 2;
+            if (g->peer_rtt_us[i] < agora - e->sent_us[i]) g->peer_rtt_us[i] = agora - e->sent_us[i];
+        }
+    }
+    if (n > 0) printf("[Node %d] instancia %d sem maioria a tempo, mandando para mais %d vizinhos\n", node_id, e->slot, n);
+    send_batch_to(node_id, g, e, targets, n);
+    e->fallback_ms = 0;
+}
+
+// instancia decidida que outro node propos: so registra os comandos aprendidos
+void report_learned(int node_id, log_entry *e, int slot) {
+    for (int i = 0; i + sm->cmd_len <= e->nvals; i += sm->cmd_len) sm->learned(node_id, e->vals + i, slot);
+}
+
+// learner: aplica em ordem as instancias que o lider avisou como decididas
+// so vale a entrada aceita na mesma proposta do aviso; entrada faltando ou de outro mandato para a aplicacao
+void learn_decided(int node_id, paxos_group *g, int ballot, int upto) {
+    while (g->commit_index < upto && log_has(g, g->commit_index + 1) &&
+           g->rlog[(g->commit_index + 1) % LOG_CAPACITY].ballot == ballot) {
+        g->commit_index++;
+        log_entry *e = &g->rlog[g->commit_index % LOG_CAPACITY];
+        e->committed = 1;
+        state_apply(node_id, g, e, g->commit_index, NULL);
+        report_learned(node_id, e, g->commit_index);
+    }
+}
+
+// fase 1: PROMISE de um lote ja aceito pelo acceptor (proposal_num = proposta com que ele aceitou)
+// fica o lote da maior proposta entre as respostas; retorna 0 se faltam valores do lote (PROMISE_VALUE
+// descartado numa fila cheia): a instancia nao conta como respondida, nunca vira "sem valor"
+int adopt_promise(paxos_group *g, msg *r) {
+    if (r->slot <= g->commit_index) return 1;
+    int novo = !log_has(g, r->slot);
+    log_entry *e = log_at(g, r->slot);
+    if (!novo && r->proposal_num <= e->ballot) return 1; // ja tem lote de proposta igual ou maior
+    if (!stage_complete(e, r->proposal_num, r->proposal_val)) return 0;
+    e->ballot = r->proposal_num;
+    e->nvals = r->proposal_val;
+    memcpy(e->vals, e->stage_vals, sizeof(int) * e->nvals);
+    return 1;
+}
+
+// comeca a contagem das instancias inteiras de cada acceptor numa fase 1
+void promise_reset(paxos_group *g) {
+    memset(g->promise_seen, 0, sizeof(g->promise_seen));
+    memset(g->promise_full, 0, sizeof(g->promise_full));
+}
+
+// PROMISE slot > 0: marca a instancia do acceptor como inteira se o lote chegou todo; reenvio repete a
+// pagina e resposta atrasada de outra fase 1 pode vir fora de ordem, so vale a maior proposta que ele mandou
+void promise_entry(paxos_group *g, msg *r) {
+    int i = r->from_id, k = r->slot % LOG_CAPACITY;
+    if (r->proposal_num + 1 < g->promise_seen[i][k]) return;
+    if (r->proposal_num + 1 > g->promise_seen[i][k]) {
+        g->promise_seen[i][k] = r->proposal_num + 1;
+        g->promise_full[i][k] = 0;
+    }
+    if (!g->promise_full[i][k] && adopt_promise(g, r)) g->promise_full[i][k] = 1;
+}
+
+// fechamento de pagina do acceptor i: as n instancias que ele mandou em [from, to) chegaram inteiras?
+int promise_whole(paxos_group *g, int i, int from, int to, int n) {
+    int inteiras = 0;
+    for (int s = from; s < to && s < from + LOG_CAPACITY; s++) inteiras += g->promise_full[i][s % LOG_CAPACITY];
+    return inteiras >= n;
+}
 
-static int known_states[KNOWN_STATES] = {42, 99, 7, 1234, 56}; 
+// fase 1 do multi-paxos: um PREPARE por mandato vale para todas as instancias a partir de from
+// cada acceptor responde em paginas de ate PROMISE_PAGE mensagens com cada instancia aceita (PROMISE_VALUE
+// dos valores e PROMISE slot > 0 com a quantidade); a pagina fecha com PROMISE_MORE (slot = onde a
+// seguinte comeca), que o lider pede com outro PREPARE da mesma proposta, ou com PROMISE slot 0 na ultima
+// o fechamento leva em proposal_val quantas instancias a pagina mandou: so conta a pagina em que todas
+// chegaram inteiras; pagina incompleta ou sem resposta em RETRANSMIT_MS e pedida de novo, em qualquer transporte
+// o log do lider fica com o lote de maior proposta de cada instancia; retorna a maior instancia vista
+// (em quem, o acceptor que a mandou), ou -1 se desistiu (NACK de um acceptor que prometeu proposta
+// maior, ou o grupo passou a outro lider)
+int run_prepare(int node_id, paxos_group *g, int ballot, int from, int *quem) {
+    g->promised_num = ballot; // o lider tambem e acceptor e promete para si
+    wal_append(g, WAL_PROMISE, ballot, 0, 0, NULL);
+    msg prep = { PREPARE, node_id, ballot, 0, from, g->id };
+    char buf[128], ts[32]; timestamp(ts,sizeof(ts));
+    snprintf(buf,sizeof(buf), "%s,%d,all,SEND,%d,\n", ts, node_id, ballot);
+    send_monitor(buf);
+    broadcast_msg(node_id, &prep);
 
-static pthread_mutex_t proposal_mtx = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t proposal_cond = PTHREAD_COND_INITIALIZER;
-static int new_proposal = 0; // flag para nova proposta
-static int fail_case = 0; // 0 = normal, 2 = lider cai depois da 1a proposta, 3 = node cai
-static int leader_alive = 1; // flag para indicar se o lider esta vivo
-static time_t last_heartbeat = 0; // timestamp do ultimo heartbeat 
+    // aguarda PROMISE de q1 nodes; cursor = pagina pedida a cada um, pedido = quando
+    int promises = 1; // ja conta o lider
+    int promised[NODES + 1] = {0};
+    promise_reset(g);
+    int cursor[NODES + 1];
+    long pedido[NODES + 1];
+    for (int i = 1; i <= NODES; i++) {
+        cursor[i] = from;
+        pedido[i] = now_ms();
+    }
+    int max_slot = g->last_slot;
+    while (promises < q1) {
+        msg r;
+        int chegou = dequeue_timeout(&g->inbox, &r, RETRANSMIT_MS / 10);
+        long agora = now_ms();
+        for (int i = 1; i <= NODES; i++) {
+            if (i == node_id || promised[i] || agora - pedido[i] < RETRANSMIT_MS) continue;
+            if (node_id != group_leader(g->id)) {
+                printf("[Node %d] grupo %d: deixou de liderar durante a fase 1 (proposal_num=%d)\n", node_id, g->id, ballot);
+                return -1;
+            }
+            pedido[i] = agora;
+            // reenvio so se as filas nao estao congestionadas, senao so aumentaria o atraso
+            if (writable_peers(node_id) < q1 - 1) continue;
+            prep.slot = cursor[i];
+            send_msg(i, &prep);
+        }
+        if (!chegou) continue;
+        if (r.type == NACK && r.proposal_num > ballot) {
+            if (r.proposal_num > g->highest_proposal) g->highest_proposal = r.proposal_num;
+            printf("[Node %d] grupo %d: PREPARE %d recusado pelo node %d (ja prometeu %d)\n", node_id, g->id, ballot, r.from_id, r.proposal_num);
+            return -1;
+        } else if (r.type == PROMISE_VALUE && r.slot > g->commit_index && !promised[r.from_id]) {
+            stage_value(log_at(g, r.slot), r.proposal_num, r.proposal_val);
+        } else if (r.type == PROMISE && r.slot > 0 && !promised[r.from_id]) {
+            promise_entry(g, &r);
+            if (r.slot > max_slot) {
+                max_slot = r.slot;
+                *quem = r.from_id;
+            }
+        } else if (r.type == PROMISE_MORE && r.proposal_num == ballot && !promised[r.from_id] && r.slot > cursor[r.from_id]) {
+            // faltou algo: o reenvio pede a pagina de novo
+            if (!promise_whole(g, r.from_id, cursor[r.from_id], r.slot, r.proposal_val)) continue;
+            // pagina completa, pede a seguinte so a quem respondeu
+            cursor[r.from_id] = r.slot;
+            pedido[r.from_id] = now_ms();
+            prep.slot = r.slot;
+            send_msg(r.from_id, &prep);
+        } else if (r.type == PROMISE && r.proposal_num == ballot && !promised[r.from_id]) {
+            if (!promise_whole(g, r.from_id, cursor[r.from_id], INT_MAX, r.proposal_val)) continue;
+            promised[r.from_id] = 1;
+            promises++;
+        } else if (r.type == COORDINATOR) {
+            leader_id = r.proposal_val;
+        }
+    }
+    return max_slot;
+}
 
-// inicializa a fila de mensagens 
-void queue_init(msg_queue *q) {
-    q->head = q->tail = q->size = 0;
-    pthread_mutex_init(&q->mtx, NULL);
-    pthread_cond_init(&q->cond, NULL);
+// fase 2 para uma instancia: quem propoe aceita o lote com a proposta ballot e manda para todos, sem esperar
+void propose(int node_id, paxos_group *g, int slot, int ballot, const int *vals, int n) {
+    log_entry *e = log_at(g, slot);
+    e->ballot = ballot;
+    e->nvals = n;
+    memcpy(e->vals, vals, sizeof(int) * n);
+    e->committed = 0;
+    e->acks = 1; // ja conta o lider
+    memset(e->acked, 0, sizeof(e->acked));
+    e->acked[node_id] = 1;
+    memset(e->sent_to, 0, sizeof(e->sent_to));
+    e->fallback_ms = 0;
+    e->mine = 1;
+    if (slot > g->last_slot) g->last_slot = slot;
+    // o aceite do proprio lote vai para o WAL junto com o envio, antes de responder ao cliente ele ja foi gravado
+    wal_append(g, WAL_ACCEPT, ballot, slot, n, vals);
+    send_accept(node_id, g, e);
 }
 
-// adiciona uma mensagem a fila de mensagens
-void enqueue(msg_queue *q, msg *m) {
-    pthread_mutex_lock(&q->mtx);
-    if (q->size < QUEUE_CAPACITY) {
-        q->data[q->tail++] = *m;
-        if (q->tail >= QUEUE_CAPACITY) q->tail = 0;
-        q->size++;
-        pthread_cond_signal(&q->cond); // sinaliza que tem mensagem nova
+// aplica em ordem as instancias decididas: so avanca commit_index sem buracos
+// cada comando do lote tem sua propria resposta para o cliente
+void apply_committed(int node_id, paxos_group *g) {
+    int gravado = 0;
+    while (log_has(g, g->commit_index + 1) && g->rlog[(g->commit_index + 1) % LOG_CAPACITY].committed) {
+        g->commit_index++;
+        log_entry *e = &g->rlog[g->commit_index % LOG_CAPACITY];
+        sm_result res[ENTRY_MAX_VALUES];
+        state_apply(node_id, g, e, g->commit_index, res);
+        // no modo mencius a instancia pode ser de outro node, quem propos e que responde ao cliente
+        if (!e->mine) {
+            report_learned(node_id, e, g->commit_index);
+            continue;
+        }
+        // o aceite deste node conta no quorum, entao o cliente so ouve falar dele depois de gravado
+        if (!gravado) {
+            wal_wait(g->wal_lsn);
+            gravado = 1;
+        }
+        for (int i = 0; i + sm->cmd_len <= e->nvals; i += sm->cmd_len) sm->reply(node_id, e->vals + i, &res[i / sm->cmd_len]);
     }
-    pthread_mutex_unlock(&q->mtx);
 }
 
-// remove uma mensagem da fila de mensagens 
-int dequeue(msg_queue *q, msg *m) {
-    pthread_mutex_lock(&q->mtx);
-    while (q->size == 0) pthread_cond_wait(&q->cond, &q->mtx); // espera mensagem
-    *m = q->data[q->head++];
-    if (q->head >= QUEUE_CAPACITY) q->head = 0;
-    q->size--;
-    pthread_mutex_unlock(&q->mtx);
-    return 1;
+// comeca um mandato: fase 1 e depois fase 2 de novo para toda instancia que algum acceptor
+// ja aceitou e que este lider nao sabe se foi decidida (buracos viram lotes vazios)
+void start_term(int node_id, paxos_group *g) {
+    g->read_barrier = INT_MAX; // sem leitura ate aplicar o que o mandato anterior pode ter decidido
+    lease_reset(g);
+    lease_hold_off(node_id, g, node_id); // este node tambem pode ter concedido lease ao lider antigo
+    // a proposta termina no id do node: dois nodes que se achem lideres do grupo ao mesmo tempo (cada um
+    // ve os vizinhos pelo seu breaker) nunca usam a mesma, nem com quoruns de fase 1 disjuntos
+    int maior = g->highest_proposal > g->promised_num ? g->highest_proposal : g->promised_num;
+    g->leader_ballot = g->highest_proposal = (maior / NODES + 1) * NODES + node_id;
+    int quem = node_id;
+    int max_slot = run_prepare(node_id, g, g->leader_ballot, g->commit_index + 1, &quem);
+    if (max_slot < 0) {
+        // sem mandato: o laco ve de novo quem lidera e, se ainda for este node, tenta com proposta maior
+        // a espera proporcional ao id evita que dois nodes que se acham lideres se derrubem sem parar
+        g->leader_ballot = 0;
+        usleep(node_id * RETRANSMIT_MS * 1000 / NODES);
+        return;
+    }
+    // instancias que ja sairam do anel dos acceptors nao vem na fase 1 e nao podem virar lote vazio:
+    // sem mandato ate o catch-up trazer o log decidido de quem esta mais adiante
+    if (max_slot - g->commit_index > LOG_CAPACITY / 2) {
+        printf("[Node %d] grupo %d: atrasado demais para liderar (instancia %d, o grupo ja esta em %d), esperando catch-up\n", node_id, g->id, g->commit_index, max_slot);
+        if (quem != node_id) catchup_note(g, quem, max_slot);
+        g->leader_ballot = 0;
+        g->lead_after = max_slot - LOG_CAPACITY / 2;
+        g->lead_wait_ms = now_ms();
+        return;
+    }
+    for (int s = g->commit_index + 1; s <= max_slot; s++) {
+        int vals[ENTRY_MAX_VALUES], n = 0;
+        if (log_has(g, s)) {
+            n = g->rlog[s % LOG_CAPACITY].nvals;
+            memcpy(vals, g->rlog[s % LOG_CAPACITY].vals, sizeof(int) * n);
+        }
+        printf("[Node %d] completando instancia %d com %d valores do mandato anterior\n", node_id, s, n);
+        propose(node_id, g, s, g->leader_ballot, vals, n);
+    }
+    g->next_slot = max_slot + 1;
+    g->read_barrier = max_slot;
 }
 
-// envia uma mensagem tcp para outro node paxos identificado por target_id
-void send_msg(int target_id, msg *m) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in addr = { .sin_family = AF_INET,
-        .sin_port = htons(BASE_PORT + target_id),
-        .sin_addr.s_addr = inet_addr("127.0.0.1") };
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
-        write(sock, m, sizeof(*m)); // envia a mensagem
+// trata um ACCEPTED no lider; a instancia e decidida quando q2 nodes aceitaram
+void leader_on_accepted(int node_id, paxos_group *g, msg *r) {
+    // ACCEPTED atrasado de outra proposta ou de instancia ja aplicada nao conta
+    if (r->slot <= g->commit_index || !log_has(g, r->slot)) return;
+    log_entry *e = &g->rlog[r->slot % LOG_CAPACITY];
+    if (!e->mine || r->proposal_num != e->ballot || e->acked[r->from_id]) return;
+    // amostra de rtt do vizinho, tambem das respostas que chegam depois da decisao
+    if (e->sent_to[r->from_id]) {
+        long amostra = now_us() - e->sent_us[r->from_id];
+        long *rtt = &g->peer_rtt_us[r->from_id];
+        *rtt = *rtt == 0 ? amostra : *rtt + (amostra - *rtt) / 8;
+    }
+    if (e->committed) {
+        e->acked[r->from_id] = 1;
+        return;
+    }
+    e->acked[r->from_id] = 1;
+    if (++e->acks >= q2) {
+        e->committed = 1;
+        // modo mencius: sem lider que avise ate onde o log esta decidido, cada instancia e avisada por quem a propos
+        // o aceite deste node conta no quorum: gravado antes que outro node aplique a instancia pelo DECIDED
+        if (mencius) {
+            wal_wait(g->wal_lsn);
+            msg d = { DECIDED, node_id, e->ballot, 0, e->slot, g->id };
+            broadcast_msg(node_id, &d);
+        }
+        apply_committed(node_id, g);
     }
-    close(sock);
 }
 
-// envia uma linha de log para o monitor
-void send_monitor(const char *line) {
-    int sock = socket(AF_INET, SOCK_DGRAM, 0);
-    struct sockaddr_in addr = { .sin_family = AF_INET,
-        .sin_port = htons(MONITOR_PORT),
-        .sin_addr.s_addr = inet_addr("127.0.0.1") };
-    sendto(sock, line, strlen(line), 0, (struct sockaddr*)&addr, sizeof(addr)); // envia log
-    close(sock);
+// lotes em voo sem quorum: no modo thrifty passado o prazo vao para os vizinhos que ficaram de fora,
+// os que estao sem resposta ha RETRANSMIT_MS sao reenviados em qualquer transporte: alem do datagrama
+// perdido no udp, fila de saida ou de entrada cheia tambem descarta ACCEPT/ACCEPTED
+void leader_retransmit(int node_id, paxos_group *g) {
+    int reenvia = writable_peers(node_id) >= q2 - 1;
+    long agora = now_ms();
+    for (int s = g->commit_index + 1; s <= g->last_slot; s++) {
+        log_entry *e = &g->rlog[s % LOG_CAPACITY];
+        if (e->slot != s || e->committed || !e->mine) continue;
+        if (e->fallback_ms != 0 && agora >= e->fallback_ms) send_accept_rest(node_id, g, e);
+        else if (reenvia && agora - e->sent_ms >= RETRANSMIT_MS) send_accept(node_id, g, e);
+    }
 }
 
-// informa ao cliente o lider eleito
-void inform_client(int elected_id) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in addr = { .sin_family = AF_INET,
-        .sin_port = htons(CLIENT_PORT),
-        .sin_addr.s_addr = inet_addr("127.0.0.1") };
-    // aguarda o client estar ouvindo
-    int tentativas = 0;
-    while (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 && tentativas < 10) {
-        usleep(200000); // espera 200ms
-        tentativas++;
+// outro node mostrou uma proposta acima da do mandato (NACK, PREPARE ou DECIDED): este lider foi substituido
+// mesmo que o breaker ainda diga que o grupo e dele; o proximo mandato, se houver, usa proposta maior
+void leader_preempted(int node_id, paxos_group *g, int ballot, int from) {
+    if (ballot > g->highest_proposal) g->highest_proposal = ballot;
+    printf("[Node %d] grupo %d: mandato %d superado pela proposta %d do node %d\n", node_id, g->id, (int)g->leader_ballot, ballot, from);
+    g->leader_ballot = 0;
+    lease_reset(g); // sem mandato tambem sem leitura pelo lease
+    // como em start_term: a espera proporcional ao id evita que dois nodes que se acham lideres se derrubem sem parar
+    usleep(node_id * RETRANSMIT_MS * 1000 / NODES);
+}
+
+// node atrasado pede o log a partir de commit_index + 1 a quem mostrou estar mais adiante
+void catchup_request(int node_id, paxos_group *g) {
+    long agora = now_ms();
+    if (g->catchup_start_ms == 0) {
+        g->catchup_start_ms = agora;
+        g->catchup_count = 0;
+        printf("[Node %d] grupo %d: atrasado na instancia %d, pedindo catch-up ao node %d (ate %d)\n", node_id, g->id, g->commit_index, (int)g->catchup_peer, (int)g->catchup_upto);
+    }
+    // snapshot pela metade: o pedido diz qual e quantas palavras ja chegaram, quem manda continua dali
+    msg req = { CATCHUP_REQ, node_id, g->snap_rx_got, g->snap_rx_index, g->commit_index + 1, g->id };
+    send_msg(g->catchup_peer, &req);
+    g->catchup_ms = agora;
+    g->catchup_base = g->commit_index;
+    g->catchup_snap_base = g->snap_rx_got;
+}
+
+// chamado no laco da thread paxos: buraco que nao fecha sozinho em CATCHUP_WAIT_MS vira pedido de catch-up
+// buraco que fecha (o seguidor so estava um pouco atras do lider) nao pede nada
+void catchup_tick(int node_id, paxos_group *g) {
+    if (g->gap_ms != 0 && g->commit_index >= g->gap_upto) g->gap_ms = 0;
+    int upto = g->catchup_upto;
+    long agora = now_ms();
+    if (upto <= g->commit_index) {
+        if (g->catchup_start_ms != 0) {
+            // redundancia completa de novo: este node tem todo o log que o resto do grupo aplicou
+            printf("[Node %d] grupo %d: catch-up completo ate a instancia %d em %ld ms (%d instancias transferidas)\n", node_id, g->id, g->commit_index, agora - g->catchup_start_ms, g->catchup_count);
+            g->catchup_start_ms = 0;
+        }
+        return;
     }
-    if (tentativas < 10) {
-        write(sock, &elected_id, sizeof(elected_id)); // envia id do lider
+    if (g->gap_ms == 0) {
+        g->gap_ms = agora;
+        g->gap_upto = upto;
+        return;
     }
-    close(sock);
+    if (agora - g->gap_ms < CATCHUP_WAIT_MS || agora - g->catchup_ms < CATCHUP_RETRY_MS) return;
+    catchup_request(node_id, g);
 }
 
-// envia confirmação ao cliente de que o valor foi aceito 
-void send_client_ok(int value) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in addr = { .sin_family = AF_INET,
-        .sin_port = htons(CLIENT_ACK_PORT),
-        .sin_addr.s_addr = inet_addr("127.0.0.1") };
-    int tentativas = 0;
-    while (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 && tentativas < 10) {
-        usleep(200000);
-        tentativas++;
+// aplica uma instancia decidida recebida pelo catch-up, so a proxima em ordem
+// a instancia propria (modo mencius ou lider no mandato) fica com apply_committed, que responde ao cliente
+void catchup_apply(int node_id, paxos_group *g, int slot, int n, const int *vals) {
+    if (slot != g->commit_index + 1) return;
+    log_entry tmp, *e = &tmp;
+    if (log_has(g, slot)) {
+        e = &g->rlog[slot % LOG_CAPACITY];
+        if (e->mine && (mencius || g->leader_ballot != 0)) {
+            apply_committed(node_id, g);
+            return;
+        }
     }
-    if (tentativas < 10) {
-        struct { int type; int value; } msg = { 1001, value }; // CLIENT_OK
-        write(sock, &msg, sizeof(msg)); // envia confirmação
+    // o valor decidido substitui o aceito: qualquer proposta acima da que decidiu tem esse mesmo valor
+    e->nvals = n;
+    memcpy(e->vals, vals, sizeof(int) * n);
+    e->committed = 1;
+    g->commit_index = slot;
+    g->catchup_count++;
+    state_apply(node_id, g, e, slot, NULL);
+    report_learned(node_id, e, slot);
+    if (mencius || g->leader_ballot != 0) apply_committed(node_id, g); // instancias ja decididas pelo caminho normal que vinham depois
+}
+
+// grava o snapshot recebido pelo catch-up e passa snap_index para ele, sob store_mtx como o snapshotter
+// gravado antes de instalar: reiniciado, o node volta do snapshot, porque o log dele nao tem o que veio antes
+int catchup_snap_write(int node_id, paxos_group *g, int index) {
+    pthread_mutex_lock(&g->store_mtx);
+    int r = snap_write(node_id, g->id, index, g->snap_rx, g->snap_rx_words);
+    if (r == 0) g->snap_index = index;
+    pthread_mutex_unlock(&g->store_mtx);
+    return r;
+}
+
+// instala o snapshot de quem esta adiante quando o log que falta ja foi compactado por ele
+// chamado com todas as palavras recebidas; confere o checksum de quem mandou antes de trocar o estado
+void catchup_install(int node_id, paxos_group *g) {
+    int index = g->snap_rx_index;
+    snapshot_header h = { 0, g->id, index, g->snap_rx_words };
+    if (snap_sum(&h, g->snap_rx) != g->snap_rx_sum) {
+        printf("[Node %d] grupo %d: snapshot da instancia %d chegou corrompido, pedindo de novo\n", node_id, g->id, index);
+    } else if (index > g->commit_index && catchup_snap_write(node_id, g, index) == 0) {
+        pthread_mutex_lock(&g->state_mtx);
+        sm->load(g, g->snap_rx, g->snap_rx_words);
+        g->applied_index = index;
+        pthread_mutex_unlock(&g->state_mtx);
+        g->commit_index = index;
+        if (g->decided_sent < index) g->decided_sent = index;
+        if (g->frontier_slot < index) g->frontier_slot = index;
+        if (g->last_slot < index) g->last_slot = index;
+        g->catchup_count += index - g->catchup_base;
+        printf("[Node %d] grupo %d: snapshot da instancia %d recebido pelo catch-up (%d palavras de estado)\n", node_id, g->id, index, g->snap_rx_words);
     }
-    close(sock);
+    free(g->snap_rx);
+    g->snap_rx = NULL;
+    g->snap_rx_index = g->snap_rx_words = g->snap_rx_got = 0;
 }
 
-// thread que escuta conexoes do cliente para receber propostas de valor
-void *client_listener(void *arg) {
-    int node_id = (int)(intptr_t)arg;
-    int port = BASE_PORT + 100 + node_id;
-    int server = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in addr = { .sin_family = AF_INET,
-        .sin_addr.s_addr = INADDR_ANY,
-        .sin_port = htons(port) };
-    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("[Node] Erro no bind do client_listener");
-        exit(1);
+// mensagens do catch-up no node atrasado: snapshot e suas palavras, valores e fim de cada lote, fim do pedaco
+void catchup_on_msg(int node_id, paxos_group *g, msg *r) {
+    if (r->type == CATCHUP_SNAP) {
+        // comeco ou continuacao de um snapshot (proposal_num = palavras, proposal_val = checksum)
+        if (r->slot <= g->commit_index || r->proposal_num < 0) return;
+        if (r->slot != g->snap_rx_index || r->proposal_num != g->snap_rx_words) {
+            free(g->snap_rx);
+            g->snap_rx = malloc(sizeof(int32_t) * (r->proposal_num + 1));
+            if (!g->snap_rx) {
+                // sem memoria agora: descarta a transferencia, o pedido seguinte recomeca do inicio
+                printf("[Node %d] grupo %d: sem memoria para o snapshot de %d palavras do catch-up\n", node_id, g->id, r->proposal_num);
+                g->snap_rx_index = g->snap_rx_words = g->snap_rx_got = 0;
+                return;
+            }
+            g->snap_rx_index = r->slot;
+            g->snap_rx_words = r->proposal_num;
+            g->snap_rx_got = 0;
+        }
+        g->snap_rx_sum = (uint32_t)r->proposal_val;
+        if (g->snap_rx_got == g->snap_rx_words) catchup_install(node_id, g);
+    } else if (r->type == CATCHUP_DATA) {
+        // palavra proposal_num do snapshot; fora de ordem (datagrama perdido) e descartada e o pedido seguinte recomeca dela
+        if (r->slot != g->snap_rx_index || r->proposal_num != g->snap_rx_got || g->snap_rx_got >= g->snap_rx_words) return;
+        g->snap_rx[g->snap_rx_got++] = r->proposal_val;
+        if (g->snap_rx_got == g->snap_rx_words) catchup_install(node_id, g);
+    } else if (r->type == CATCHUP_VALUE) {
+        if (r->slot != g->catchup_slot) {
+            g->catchup_slot = r->slot;
+            g->catchup_got = 0;
+        }
+        if (r->proposal_num < 0 || r->proposal_num >= ENTRY_MAX_VALUES) return;
+        g->catchup_vals[r->proposal_num] = r->proposal_val;
+        g->catchup_got++;
+    } else if (r->type == CATCHUP_ENTRY) {
+        if (r->proposal_val < 0 || r->proposal_val > ENTRY_MAX_VALUES) return;
+        // lote incompleto (datagrama perdido) para a aplicacao, o pedido seguinte recomeca dele
+        if (r->proposal_val > 0 && (r->slot != g->catchup_slot || g->catchup_got != r->proposal_val)) return;
+        catchup_apply(node_id, g, r->slot, r->proposal_val, g->catchup_vals);
+        g->catchup_slot = 0;
+    } else if (r->type == CATCHUP_END) {
+        // pedaco aplicado: com progresso e ainda atras de quem mandou pede o proximo sem esperar
+        catchup_note(g, r->from_id, r->proposal_val);
+        int andou = g->commit_index > g->catchup_base || g->snap_rx_got > g->catchup_snap_base;
+        if (andou && g->commit_index < r->proposal_val) catchup_request(node_id, g);
     }
-    if (listen(server, 5) < 0) {
-        perror("[Node] Erro no listen do client_listener");
-        exit(1);
+}
+
+// acceptor: uma pagina da resposta ao PREPARE r, as instancias aceitas a partir de r->slot ate PROMISE_PAGE
+// mensagens (sempre pelo menos uma instancia); fecha com PROMISE_MORE na instancia em que a proxima pagina
+// comeca ou, sem mais nada, com o PROMISE slot 0, os dois com quantas instancias a pagina levou
+void promise_page(int node_id, paxos_group *g, msg *r) {
+    int from = r->slot > g->last_slot - LOG_CAPACITY ? r->slot : g->last_slot - LOG_CAPACITY + 1;
+    int enviadas = 0, instancias = 0;
+    for (int s = from; s <= g->last_slot; s++) {
+        if (!log_has(g, s)) continue;
+        log_entry *e = &g->rlog[s % LOG_CAPACITY];
+        if (enviadas > 0 && enviadas + e->nvals + 1 > PROMISE_PAGE) {
+            msg mais = { PROMISE_MORE, node_id, r->proposal_num, instancias, s, g->id };
+            hold_msg(node_id, g, r->from_id, &mais);
+            return;
+        }
+        for (int i = 0; i < e->nvals; i++) {
+            msg v = { PROMISE_VALUE, node_id, pack_pos(e->ballot, i), e->vals[i], s, g->id };
+            hold_msg(node_id, g, r->from_id, &v);
+        }
+        msg ent = { PROMISE, node_id, e->ballot, e->nvals, s, g->id };
+        hold_msg(node_id, g, r->from_id, &ent);
+        enviadas += e->nvals + 1;
+        instancias++;
     }
-    printf("[Node %d] client_listener escutando na porta %d\n", node_id, port);
-    int propostas_recebidas = 0;
-    while (1) {
-        int c = accept(server, NULL, NULL); // aceita conexao do cliente
-        struct { int type; int value; } m;
-        if (read(c, &m, sizeof(m)) == sizeof(m) && m.type == 1000) { 
-            // recebeu proposta do cliente
-            pthread_mutex_lock(&proposal_mtx);
-            proposal_value = m.value; 
-            new_proposal = 1;
-            pthread_cond_signal(&proposal_cond); // sinaliza nova proposta
-            pthread_mutex_unlock(&proposal_mtx);
-            printf("[Node %d] Received value %d from client\n", node_id, m.value);
-            propostas_recebidas++;
-            if (fail_case == 2 && node_id == leader_id && propostas_recebidas == 1) {
-                printf("[Node %d] Simulando falha do líder após 1a proposta\n", node_id);
-                exit(99);
-            }
-            if (fail_case == 4 && node_id == leader_id && propostas_recebidas == 2) {
-                printf("[Node %d] Simulando falha do líder após 2a proposta\n", node_id);
-                exit(96);
-            }
-        }
-        close(c);
+    msg prom = { PROMISE, node_id, r->proposal_num, instancias, 0, g->id };
+    hold_msg(node_id, g, r->from_id, &prom);
+}
+
+// menor proposta que o acceptor ainda aceita na instancia slot
+// no modo mencius a promessa e por dono e so cobre a faixa revogada; fora dela vale a proposta fixa do dono
+int accept_promise(paxos_group *g, int slot) {
+    if (!mencius) return g->promised_num;
+    int o = owner_of(slot);
+    return slot >= g->owner_from[o] && slot <= g->owner_to[o] ? g->owner_promise[o] : 0;
+}
+
+// valor de um lote, guardado ate o ACCEPT que fecha o lote
+void on_accept_value(paxos_group *g, msg *r) {
+    if (r->slot <= g->last_slot - LOG_CAPACITY) return;
+    if (r->proposal_num / ENTRY_MAX_VALUES >= accept_promise(g, r->slot)) stage_value(log_at(g, r->slot), r->proposal_num, r->proposal_val);
+}
+
+// acceptor recebeu ACCEPT (proposal_val = tamanho do lote) valida os comandos e responde com ACCEPTED se forem validos
+void on_accept(int node_id, paxos_group *g, msg *r) {
+    // promessa e anel antes de log_at: a posicao pode guardar o aceite de outra instancia
+    int prometido = accept_promise(g, r->slot);
+    if (r->proposal_num < prometido) {
+        // lider antigo, ja prometeu para uma proposta maior: o NACK avisa que o mandato dele acabou
+        printf("[Node %d] Ignorou ACCEPT %d do node %d (ja prometeu %d)\n", node_id, r->proposal_num, r->from_id, prometido);
+        if (!mencius) {
+            msg nack = { NACK, node_id, prometido, 0, r->slot, g->id };
+            send_msg(r->from_id, &nack);
+        }
+        return;
+    }
+    if (r->slot <= g->last_slot - LOG_CAPACITY) return; // reenvio atrasado de instancia que ja saiu do anel
+    log_entry *e = log_at(g, r->slot);
+    if (!stage_complete(e, r->proposal_num, r->proposal_val)) {
+        // faltou valor do lote (datagrama perdido), o reenvio do lider manda tudo de novo
+        return;
+    }
+    int aceito = r->proposal_val % sm->cmd_len == 0, invalido = 0;
+    for (int i = 0; i + sm->cmd_len <= r->proposal_val; i += sm->cmd_len) {
+        if (!sm->valid(e->stage_vals + i)) {
+            aceito = 0;
+            invalido = e->stage_vals[i];
+            break;
+        }
+    }
+    if (aceito) {
+        // no multi-paxos o ACCEPT do mandato atual dispensa um PREPARE por instancia
+        if (!mencius) g->promised_num = r->proposal_num;
+        e->ballot = r->proposal_num;
+        e->mine = 0;
+        e->nvals = r->proposal_val;
+        memcpy(e->vals, e->stage_vals, sizeof(int) * e->nvals);
+        if (r->slot > g->last_slot) g->last_slot = r->slot;
+        wal_append(g, WAL_ACCEPT, r->proposal_num, r->slot, e->nvals, e->vals);
+        printf("[Node %d] Aceitou lote de %d valores do lider %d (instancia %d, proposal_num=%d)\n", node_id, r->proposal_val, r->from_id, r->slot, r->proposal_num);
+        char ts[32], buf[128];
+        timestamp(ts, sizeof(ts));
+        snprintf(buf, sizeof(buf), "%s,%d,%d,RECV_ACCEPT,%d,%d\n", ts, node_id, r->from_id, r->proposal_num, r->proposal_val);
+        send_monitor(buf);
+        
+        // envia a mensagem de accepted, depois de gravado o aceite
+        msg accd = { ACCEPTED, node_id, r->proposal_num, r->proposal_val, r->slot, g->id };
+        hold_msg(node_id, g, r->from_id, &accd);
+
+        printf("[Node %d] Enviou ACCEPTED para o lider %d (proposal_num=%d, valores=%d)\n", node_id, r->from_id, r->proposal_num, r->proposal_val);
+        timestamp(ts, sizeof(ts));
+        snprintf(buf, sizeof(buf), "%s,%d,%d,SEND_ACCEPTED,%d,%d\n", ts, node_id, r->from_id, r->proposal_num, r->proposal_val);
+        send_monitor(buf);
+    } else {
+        printf("[Node %d] Rejeitou valor %d do lider %d (proposal_num=%d)\n", node_id, invalido, r->from_id, r->proposal_num);
     }
-    return NULL;
 }
 
-// gera um timestamp formatado para logs
-void timestamp(char *buf, size_t sz) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    struct tm *tm = localtime(&tv.tv_sec);
-    strftime(buf, sz, "%Y-%m-%dT%H:%M:%S", tm);
-    int ms = tv.tv_usec/1000;
-    snprintf(buf + strlen(buf), sz - strlen(buf), ".%03d", ms);
+// junta num lote a proposta p e as seguintes da fila, esperando ate batch_ms por mais, no maximo batch_max
+// comandos e o que couber numa instancia; retorna quantos inteiros (comandos validos) ficaram em vals
+int collect_batch(int node_id, paxos_group *g, msg *p, int *vals) {
+    int n = 0;
+    long fecha = now_ms() + batch_ms;
+    do {
+        int val = p->proposal_val;
+        // loga o recebimento do valor do cliente
+        char ts2[32], buf2[128];
+        timestamp(ts2, sizeof(ts2));
+        snprintf(buf2, sizeof(buf2), "%s,%d,client,RECV_VALUE,%d,\n", ts2, node_id, val);
+        send_monitor(buf2);
+
+        // valida o pedido e monta o comando da maquina de estados
+        if (!sm->encode(p, vals + n)) {
+            printf("[Node %d] Valor inválido recebido do client: %d\n", node_id, val);
+            continue;
+        }
+        n += sm->cmd_len;
+        if (n / sm->cmd_len >= batch_max || n + sm->cmd_len > ENTRY_MAX_VALUES) break;
+    } while (dequeue_timeout(&g->proposals, p, fecha > now_ms() ? (int)(fecha - now_ms()) : 0));
+    return n;
 }
 
-// thread que escuta mensagens tcp de outros nodes
-void *listener(void *arg) {
-    int node_id = (int)(intptr_t)arg;
-    int server = socket(AF_INET, SOCK_STREAM, 0);
-    struct sockaddr_in sin = { .sin_family = AF_INET,
-        .sin_addr.s_addr = INADDR_ANY,
-        .sin_port = htons(BASE_PORT + node_id) };
-    bind(server, (struct sockaddr*)&sin, sizeof(sin));
-    listen(server, NODES);
-    while (1) {
-        int c = accept(server, NULL, NULL); // aceita conexao de outro node
-        msg m;
-        if (read(c, &m, sizeof(m)) == sizeof(m)) {
-            if (m.type == HEARTBEAT) {
-                last_heartbeat = time(NULL); // atualiza timestamp do heartbeat
-            } else {
-                enqueue(&inbox, &m); // coloca mensagem na fila
-            }
+// modo mencius: marca como decididas sem valor as instancias de owner em [first, until)
+void mencius_noop(paxos_group *g, int owner, int first, int until) {
+    for (int s = first; s < until && s - g->commit_index < LOG_CAPACITY; s += NODES) {
+        if (s <= g->commit_index || owner_of(s) != owner) continue;
+        log_entry *e = log_at(g, s);
+        if (e->committed) continue;
+        if (e->ballot == 0) e->ballot = MENCIUS_BALLOT;
+        e->nvals = 0;
+        e->committed = 1;
+    }
+}
+
+// modo mencius: outro node ja propos na instancia upto, entao as instancias deste node abaixo dela
+// que ainda nao foram usadas viram lote vazio; um SKIP avisa todos da faixa inteira de uma vez
+void mencius_skip(int node_id, paxos_group *g, int upto) {
+    // instancia fora do anel fica para o proximo ACCEPT, o anel nao pode sobrescrever o que falta aplicar
+    if (upto - g->commit_index > LOG_CAPACITY / 2) upto = g->commit_index + LOG_CAPACITY / 2;
+    if (g->next_slot >= upto) return;
+    int first = g->next_slot;
+    while (g->next_slot < upto) g->next_slot += NODES;
+    mencius_noop(g, node_id, first, g->next_slot);
+    // o SKIP sai depois do WAL gravar o ACCEPT que o provocou: reiniciado, este node nao propoe abaixo dele
+    msg sk = { SKIP, node_id, first, 0, g->next_slot, g->id };
+    hold_msg(node_id, g, 0, &sk);
+    apply_committed(node_id, g);
+}
+
+// mensagens dos lotes deste node ainda sem quorum: ficam na fila do grupo de cada seguidor ate ele
+// responder, e a fila descarta o que passa da capacidade; lote cheio sao ENTRY_MAX_VALUES + 1 mensagens
+int in_flight_msgs(paxos_group *g) {
+    int n = 0;
+    for (int s = g->commit_index + 1; s <= g->last_slot; s++) {
+        log_entry *e = &g->rlog[s % LOG_CAPACITY];
+        if (e->slot == s && e->mine && !e->committed) n += e->nvals + 1;
+    }
+    return n;
+}
+
+// modo mencius: instancias deste node propostas e ainda nao decididas
+int mencius_in_flight(paxos_group *g) {
+    int n = 0;
+    for (int s = g->next_slot - NODES; s > g->commit_index; s -= NODES) {
+        if (log_has(g, s) && g->rlog[s % LOG_CAPACITY].mine && !g->rlog[s % LOG_CAPACITY].committed) n++;
+    }
+    return n;
+}
+
+// modo mencius: PREPARE de revogacao (proposal_val = ultima instancia revogada, slot = primeira)
+// promete para o dono da primeira instancia so na faixa e responde com os lotes dele que ja aceitou
+void mencius_prepare(int node_id, paxos_group *g, msg *r) {
+    int o = owner_of(r->slot);
+    if (r->proposal_num > g->highest_proposal) g->highest_proposal = r->proposal_num;
+    if (r->proposal_num <= g->owner_promise[o]) {
+        printf("[Node %d] Ignorou PREPARE %d do node %d (ja prometeu %d)\n", node_id, r->proposal_num, r->from_id, g->owner_promise[o]);
+        return;
+    }
+    g->owner_promise[o] = r->proposal_num;
+    g->owner_from[o] = r->slot;
+    g->owner_to[o] = r->proposal_val;
+    wal_append(g, WAL_OWNER, r->proposal_num, r->slot, r->proposal_val, NULL);
+    // este node foi dado como parado: as instancias dele ainda sem uso na faixa ficam sem valor, como no revogador
+    if (o == node_id) mencius_skip(node_id, g, r->proposal_val + 1);
+    int instancias = 0;
+    for (int s = r->slot; s <= r->proposal_val; s += NODES) {
+        if (!log_has(g, s) || g->rlog[s % LOG_CAPACITY].ballot == 0) continue;
+        log_entry *e = &g->rlog[s % LOG_CAPACITY];
+        for (int i = 0; i < e->nvals; i++) {
+            msg v = { PROMISE_VALUE, node_id, pack_pos(e->ballot, i), e->vals[i], s, g->id };
+            hold_msg(node_id, g, r->from_id, &v);
         }
-        close(c);
+        msg ent = { PROMISE, node_id, e->ballot, e->nvals, s, g->id };
+        hold_msg(node_id, g, r->from_id, &ent);
+        instancias++;
     }
-    return NULL;
+    // o fechamento diz quantas instancias foram mandadas, o revogador so conta a promessa com todas
+    msg prom = { PROMISE, node_id, r->proposal_num, instancias, 0, g->id };
+    hold_msg(node_id, g, r->from_id, &prom);
 }
 
-// thread responsavel por executar a eleicao de lider entre os nodes
-void *election(void *arg) {
-    int node_id = (int)(intptr_t)arg; 
-    srand(time(NULL) + node_id);
-    int my_num = rand() % 10000; // num aleatorio para eleicao
-    msg m = { ELECTION, node_id, 0, my_num };
-    // envia mensagem de candidatura para todos os outros nodes
-    for (int i = 1; i <= NODES; i++) if (i != node_id) send_msg(i, &m);
+// modo mencius: resposta a revogacao deste node; com q1 promessas propoe nas instancias revogadas
+// o lote aceito de maior proposta ou, se ninguem aceitou nada, lote vazio
+void mencius_on_promise(int node_id, paxos_group *g, msg *r) {
+    if (g->revoke_ballot == 0 || g->revoke_promised[r->from_id]) return;
+    if (r->slot > 0 && (r->slot < g->revoke_from || r->slot > g->revoke_to)) return;
+    if (r->type == PROMISE_VALUE) {
+        if (r->slot > g->commit_index) stage_value(log_at(g, r->slot), r->proposal_num, r->proposal_val);
+        return;
+    }
+    if (r->slot > 0) {
+        promise_entry(g, r);
+        return;
+    }
+    // lote faltando: esta promessa nao conta, sem quorum a revogacao e refeita depois de REVOKE_MS
+    if (r->proposal_num != g->revoke_ballot || !promise_whole(g, r->from_id, g->revoke_from, g->revoke_to + 1, r->proposal_val)) return;
+    g->revoke_promised[r->from_id] = 1;
+    if (++g->revoke_promises < q1) return;
+    for (int s = g->revoke_from; s <= g->revoke_to; s += NODES) {
+        if (s <= g->commit_index || (log_has(g, s) && g->rlog[s % LOG_CAPACITY].committed)) continue;
+        int vals[ENTRY_MAX_VALUES], n = 0;
+        if (log_has(g, s) && g->rlog[s % LOG_CAPACITY].ballot > 0) {
+            n = g->rlog[s % LOG_CAPACITY].nvals;
+            memcpy(vals, g->rlog[s % LOG_CAPACITY].vals, sizeof(int) * n);
+        }
+        propose(node_id, g, s, g->revoke_ballot, vals, n);
+    }
+    g->revoke_ballot = 0;
+    g->frontier_ms = now_ms(); // as instancias revogadas tem REVOKE_MS para fechar antes de outra revogacao
+}
 
-    int best_num = my_num, best_id = node_id, received = 0;
-    // coleta candidaturas dos outros nodes
-    while (received < NODES - 1) {
+// modo mencius: fronteira do log parada ha REVOKE_MS numa instancia de um dono que nao manda nada ha REVOKE_MS
+// o menor node vivo revoga as instancias dele nas proximas LOG_CAPACITY / 4 com uma fase 1 so para elas
+// a proposta termina no id do node, dois revogadores nunca usam a mesma
+void mencius_revoke(int node_id, paxos_group *g) {
+    long agora = now_ms();
+    if (g->commit_index != g->frontier_slot) {
+        g->frontier_slot = g->commit_index;
+        g->frontier_ms = agora;
+        return;
+    }
+    if (g->revoke_ballot != 0 && agora - g->revoke_ms < REVOKE_MS) return; // sem quorum a tempo, refaz
+    int f = g->commit_index + 1, o = owner_of(f);
+    if (o == node_id || agora - g->frontier_ms < REVOKE_MS || agora - last_recv_ms[o] < REVOKE_MS) return;
+    for (int i = 1; i < node_id; i++) {
+        if (i != o && agora - last_recv_ms[i] < REVOKE_MS) return;
+    }
+    int maior = g->highest_proposal > g->owner_promise[o] ? g->highest_proposal : g->owner_promise[o];
+    int b = (maior / NODES + 1) * NODES + node_id;
+    g->highest_proposal = b;
+    g->revoke_ballot = b;
+    g->revoke_from = f;
+    g->revoke_to = f + LOG_CAPACITY / 4;
+    g->revoke_ms = agora;
+    g->revoke_promises = 1; // ja conta este node
+    memset(g->revoke_promised, 0, sizeof(g->revoke_promised));
+    g->revoke_promised[node_id] = 1;
+    promise_reset(g);
+    g->owner_promise[o] = b;
+    g->owner_from[o] = g->revoke_from;
+    g->owner_to[o] = g->revoke_to;
+    wal_append(g, WAL_OWNER, b, f, g->revoke_to, NULL);
+    printf("[Node %d] node %d parado na instancia %d, revogando as instancias dele ate %d (proposal_num=%d)\n", node_id, o, f, g->revoke_to, b);
+    msg prep = { PREPARE, node_id, b, g->revoke_to, f, g->id };
+    broadcast_msg(node_id, &prep);
+}
+
+// modo mencius: uma mensagem do grupo; todo node e acceptor e learner das instancias de todos
+void mencius_on_msg(int node_id, paxos_group *g, msg *r) {
+    if (r->type == COORDINATOR) {
+        leader_id = r->proposal_val;
+    } else if (r->type == ACCEPT_VALUE) {
+        on_accept_value(g, r);
+    } else if (r->type == ACCEPT) {
+        // proposta de outro node na instancia slot: as deste node abaixo dela nao vao ser usadas
+        mencius_skip(node_id, g, owner_of(r->slot) == node_id ? r->slot + 1 : r->slot);
+        on_accept(node_id, g, r);
+    } else if (r->type == ACCEPTED) {
+        leader_on_accepted(node_id, g, r);
+    } else if (r->type >= CATCHUP_VALUE && r->type <= CATCHUP_DATA) {
+        catchup_on_msg(node_id, g, r);
+    } else if (r->type == DECIDED && r->slot > g->commit_index && !log_has(g, r->slot)) {
+        catchup_note(g, r->from_id, r->slot); // sem o ACCEPT: se o buraco nao fechar, vem pelo catch-up
+    } else if (r->type == DECIDED && r->slot > g->commit_index) {
+        // decidida com a proposta que este node aceitou; sem o ACCEPT espera o reenvio
+        log_entry *e = &g->rlog[r->slot % LOG_CAPACITY];
+        if (e->ballot != r->proposal_num) return;
+        e->committed = 1;
+        apply_committed(node_id, g);
+    } else if (r->type == SKIP) {
+        mencius_noop(g, r->from_id, r->proposal_num, r->slot);
+        apply_committed(node_id, g);
+    } else if (r->type == PREPARE) {
+        mencius_prepare(node_id, g, r);
+    } else if (r->type == PROMISE || r->type == PROMISE_VALUE) {
+        mencius_on_promise(node_id, g, r);
+    }
+}
+
+// modo mencius: sem lider fixo, a instancia s e do node owner_of(s) e cada node propoe direto nas suas,
+// com MENCIUS_BALLOT e sem fase 1; instancia sem uso vira lote vazio (SKIP) e dono parado e revogado
+void mencius_loop(int node_id, paxos_group *g) {
+    // primeira instancia deste node; reiniciado, continua depois de tudo o que o WAL mostra aceito ou revogado
+    g->next_slot = node_id;
+    while (g->next_slot <= g->last_slot || g->next_slot <= g->owner_to[node_id]) g->next_slot += NODES;
+    g->frontier_ms = now_ms();
+    while (1) {
+        wal_checkpoint(g);
+        store_compact(node_id, g);
+        catchup_tick(node_id, g);
+        // o catch-up pode ter levado o log alem das instancias que este node ia propor
+        while (g->next_slot <= g->commit_index) g->next_slot += NODES;
         msg r;
-        dequeue(&inbox, &r);
-        if (r.type == ELECTION) {
-            // atualiza o melhor candidato
-            if (r.proposal_val > best_num || (r.proposal_val == best_num && r.from_id > best_id)) {
-                best_num = r.proposal_val;
-                best_id = r.from_id;
+        int ocupado = 0;
+        while (dequeue_timeout(&g->inbox, &r, 0)) {
+            mencius_on_msg(node_id, g, &r);
+            ocupado = 1;
+        }
+        wal_release(node_id, g); // um fsync para tudo o que as mensagens acima mudaram
+        // com espaco na janela e no anel junta as propostas do cliente na proxima instancia deste node;
+        // as filas dos outros nodes recebem os lotes de todos, cada node fica com uma parte delas
+        msg p;
+        int voo = mencius_in_flight(g);
+        if (voo < window && (voo == 0 || in_flight_msgs(g) + ENTRY_MAX_VALUES + 1 <= INFLIGHT_MSGS / NODES) &&
+            g->next_slot - g->commit_index < LOG_CAPACITY / 2 && dequeue_timeout(&g->proposals, &p, 0)) {
+            int vals[ENTRY_MAX_VALUES];
+            int n = collect_batch(node_id, g, &p, vals);
+            if (n > 0) {
+                wait_writable(node_id, q2 - 1);
+                int s = g->next_slot;
+                g->next_slot += NODES;
+                propose(node_id, g, s, MENCIUS_BALLOT, vals, n);
             }
-            received++;
+            ocupado = 1;
         }
+        mencius_revoke(node_id, g);
+        leader_retransmit(node_id, g);
+        if (!ocupado && dequeue_timeout(&g->inbox, &r, 1)) mencius_on_msg(node_id, g, &r);
     }
-    leader_id = best_id; // define o lider eleito
-    msg coord = { COORDINATOR, node_id, 0, best_id };
-    // informa todos os nodes sobre o lider eleito
-    for (int i = 1; i <= NODES; i++) if (i != node_id) send_msg(i, &coord);
-    char buf[128], ts[32];
-    timestamp(ts, sizeof(ts));
-    snprintf(buf, sizeof(buf), "%s,%d,all,ELECT,%d,%d\n", ts, node_id, my_num, best_id);
-    send_monitor(buf); // loga eleicao
-    election_done = 1;
-    printf("[Node %d] Leader elected: %d\n", node_id, leader_id);
-    if (node_id == leader_id) {
-        // se for o lider informa o cliente e inicia thread para escutar propostas
-        sleep(1);
-        inform_client(leader_id); 
-        pthread_t ct;
-        pthread_create(&ct, NULL, client_listener, (void*)(intptr_t)node_id); 
-        pthread_detach(ct);
+}
+
+// mensagem da fila do grupo enquanto este node lidera: ACCEPTED das instancias em voo, catch-up e o que
+// mostra que outro node assumiu o grupo com um mandato maior
+void leader_on_msg(int node_id, paxos_group *g, msg *r) {
+    if (r->type == ACCEPTED) {
+        leader_on_accepted(node_id, g, r);
+        // com ACCEPTED chegando sem parar o prazo do modo thrifty nao passaria pelo timeout da espera
+        if (thrifty) leader_retransmit(node_id, g);
+    } else if (r->type == COORDINATOR) {
+        leader_id = r->proposal_val;
+    } else if (r->type >= CATCHUP_VALUE && r->type <= CATCHUP_DATA) {
+        catchup_on_msg(node_id, g, r);
+    } else if ((r->type == NACK || r->type == PREPARE || r->type == DECIDED) && r->proposal_num > g->leader_ballot) {
+        leader_preempted(node_id, g, r->proposal_num, r->from_id);
+    } else if (r->type == HEARTBEAT && r->proposal_val > g->leader_ballot) {
+        leader_preempted(node_id, g, r->proposal_val, r->from_id); // rodada de lease de um mandato maior
     }
-    return NULL;
 }
 
+// argumento da thread paxos de um grupo
+typedef struct group_thread {
+    int node_id;
+    paxos_group *g;
+} group_thread;
+
 // thread principal do algoritmo paxos executa o consenso sobre valores propostos
 void *paxos(void *arg) {
-    int node_id = (int)(intptr_t)arg;
+    group_thread gt = *(group_thread *)arg;
+    free(arg);
+    int node_id = gt.node_id;
+    paxos_group *g = gt.g;
     // espera ate que a eleicao do lider seja feita
     while (!election_done) usleep(100000);
 
-    if (fail_case == 3 && node_id != leader_id) {
+    if (fail_case == 3 && node_id != leader_id && g->id == 0) {
         printf("[Node %d] Simulando falha de nó não-líder\n", node_id);
         exit(97);
     }
+    if (mencius) mencius_loop(node_id, g); // nao retorna
 
     while (1) {
-        // se este node eh o lider
-        if (node_id == leader_id) {
-            // aguarda uma nova proposta do cliente 
-            pthread_mutex_lock(&proposal_mtx);
-            while (!new_proposal) pthread_cond_wait(&proposal_cond, &proposal_mtx);
-            int val = proposal_value;
-            new_proposal = 0;
-            pthread_mutex_unlock(&proposal_mtx);
-
-            // loga o recebimento do valor do cliente
-            char ts2[32], buf2[128];
-            timestamp(ts2, sizeof(ts2));
-            snprintf(buf2, sizeof(buf2), "%s,%d,client,RECV_VALUE,%d,\n", ts2, node_id, val);
-            send_monitor(buf2);
-
-            // valida se o valor proposto  esta nos valores conhecidos
-            int valido = 0;
-            for (int i = 0; i < KNOWN_STATES; i++) {
-                if (known_states[i] == val) {
-                    valido = 1;
-                    break;
+        // trabalho pedido pela thread snapshotter
+        wal_checkpoint(g);
+        store_compact(node_id, g);
+        // se este node eh o lider do grupo
+        if (node_id == group_leader(g->id)) {
+            wal_release(node_id, g); // respostas de quando ainda era seguidor
+            // lider atrasado tambem pede o log a quem esta mais adiante
+            catchup_tick(node_id, g);
+            // fase 1 so uma vez por mandato, depois cada valor e so fase 2
+            if (g->leader_ballot == 0) {
+                // lider atrasado demais: so pede e aplica o catch-up ate o log voltar para dentro do anel
+                if (g->commit_index < g->lead_after && now_ms() - g->lead_wait_ms < LEAD_CATCHUP_MS) {
+                    msg r;
+                    if (dequeue_timeout(&g->inbox, &r, 100) && r.type >= CATCHUP_VALUE && r.type <= CATCHUP_DATA) catchup_on_msg(node_id, g, &r);
+                    continue;
                 }
+                start_term(node_id, g);
+                if (g->leader_ballot == 0) continue;
             }
-            if (!valido) {
-                printf("[Node %d] Valor inválido recebido do client: %d\n", node_id, val);
-                continue;
-            }
+            // le a fila sem esperar mesmo sem nada em voo: o lider ocioso so espera propostas e, sem isso,
+            // nunca veria o NACK, PREPARE, DECIDED ou lease de um mandato maior, e a fila do grupo encheria
+            msg r;
+            while (g->leader_ballot > 0 && dequeue_timeout(&g->inbox, &r, 0)) leader_on_msg(node_id, g, &r);
+            if (g->leader_ballot == 0) continue;
 
-            // inicia uma nova rodada de consenso incrementando o num da proposta
-            highest_proposal++;
-            promise_count = 0;
-            accepted_count = 0;
-            // prepara e envia mensagem PREPARE para todos os outros nodes
-            msg prep = { PREPARE, node_id, highest_proposal, 0 };
-            char buf[128], ts[32]; timestamp(ts,sizeof(ts));
-            snprintf(buf,sizeof(buf), "%s,%d,all,SEND,%d,\n", ts, node_id, highest_proposal);
-            send_monitor(buf);
-            for (int i = 1; i <= NODES; i++) if (i != node_id) send_msg(i,&prep);
-
-            // aguarda PROMISE de uma maioria dos nodes
-            int promises = 1; // ja conta o lider
-            while (promises <= NODES/2) {
-                msg r;
-                dequeue(&inbox, &r);
-                if (r.type == PROMISE && r.proposal_num == highest_proposal) {
-                    promises++;
-                } else if (r.type == COORDINATOR) {
-                    leader_id = r.proposal_val;
-                }
-            }
+            // com espaco na janela junta as propostas do cliente num lote; sem nada em voo espera a primeira
+            int em_voo = g->next_slot - 1 - g->commit_index;
+            // vai dormir esperando proposta: a decisao pendente nao espera o proximo ACCEPT
+            if (em_voo == 0 && g->decided_sent < g->commit_index) send_decided(node_id, g);
+            // a janela tambem para quando os lotes em voo ja ocupam INFLIGHT_MSGS na fila dos seguidores
+            msg p;
+            int cabe = em_voo == 0 || in_flight_msgs(g) + ENTRY_MAX_VALUES + 1 <= INFLIGHT_MSGS;
+            if (em_voo < window && cabe && dequeue_timeout(&g->proposals, &p, em_voo == 0 ? 100 : 0)) {
+                int vals[ENTRY_MAX_VALUES];
+                int n = collect_batch(node_id, g, &p, vals);
+                if (n == 0) continue;
 
-            // envia mensagem ACCEPT para todos os outros nodes com o valor proposto
-            msg acc = { ACCEPT, node_id, highest_proposal, val };
-            for (int i = 1; i <= NODES; i++) if (i != node_id) send_msg(i,&acc);
-
-            // aguarda ACCEPTED de uma maioria dos nodes
-            int accepteds = 1; // ja conta o lider
-            accepted_value = val;
-            while (accepteds <= NODES/2) {
-                msg r;
-                dequeue(&inbox, &r);
-                if (r.type == ACCEPTED && r.proposal_num == highest_proposal) {
-                    accepteds++;
-                } else if (r.type == COORDINATOR) {
-                    leader_id = r.proposal_val;
-                }
+                // backpressure: sem vizinhos com espaco na fila para o quorum da fase 2 a instancia nao fecha
+                wait_writable(node_id, q2 - 1);
+                propose(node_id, g, g->next_slot++, g->leader_ballot, vals, n);
+                continue;
             }
+            // sem ACCEPT novo para levar a decisao, avisa os seguidores num DECIDED proprio
+            if (g->decided_sent < g->commit_index) send_decided(node_id, g);
+            if (em_voo == 0 && g->catchup_upto <= g->commit_index) continue;
 
-            // consenso atingido, informa o cliente
-            printf("[Node %d] CONSENSUS on %d\n", node_id, val);
-            send_client_ok(val);
+            // espera ACCEPTED das instancias em voo (e o catch-up, se estiver atrasado)
+            if (!dequeue_timeout(&g->inbox, &r, RETRANSMIT_MS / 10)) {
+                leader_retransmit(node_id, g);
+                continue;
+            }
+            leader_on_msg(node_id, g, &r);
         } else {
             // node seguidor processa mensagens recebidas
+            // sem mensagem volta a ver quem lidera o grupo, a lideranca pode mudar sem nada chegar aqui
             msg r;
-            dequeue(&inbox, &r);
+            g->leader_ballot = 0; // se virar lider do grupo refaz a fase 1
+            catchup_tick(node_id, g);
+            if (!dequeue_timeout(&g->inbox, &r, 0)) {
+                // fila vazia: um fsync grava o que o lote de mensagens mudou e as respostas guardadas saem
+                wal_release(node_id, g);
+                if (!dequeue_timeout(&g->inbox, &r, 100)) continue;
+            }
+            // o proximo mandato deste node precisa de uma proposta maior que todas ja vistas
+            if (r.type == PREPARE && r.proposal_num > g->highest_proposal) g->highest_proposal = r.proposal_num;
             if (r.type == COORDINATOR) {
                 // atualiza o lider se receber mensagem de COORDINATOR
                 leader_id = r.proposal_val;
+            } else if (r.type == PREPARE && r.proposal_num < g->promised_num) {
+                // NACK: o candidato desiste da fase 1 e volta com proposta maior que a prometida
+                printf("[Node %d] Ignorou PREPARE %d do node %d (ja prometeu %d)\n", node_id, r.proposal_num, r.from_id, g->promised_num);
+                msg nack = { NACK, node_id, g->promised_num, 0, r.slot, g->id };
+                send_msg(r.from_id, &nack);
+            } else if (r.type == PREPARE && lease_wait(node_id, g, r.from_id) > 0) {
+                // promessa do lease: nenhum outro node vira lider antes do lease concedido vencer
+                // sem resposta a thread segue com o lider atual; o candidato reenvia o PREPARE a cada RETRANSMIT_MS
+                printf("[Node %d] PREPARE do node %d espera pelo lease do node %d\n", node_id, r.from_id, g->lease_holder);
             } else if (r.type == PREPARE) {
-                // recebeu PREPARE responde com PROMISE
+                // recebeu PREPARE responde com PROMISE, antes mandando as instancias que ja aceitou
+                // a mesma proposta de novo (as propostas sao unicas por node) e o pedido da pagina seguinte ou um reenvio
+                if (r.proposal_num > g->promised_num) {
+                    g->promised_num = r.proposal_num;
+                    wal_append(g, WAL_PROMISE, r.proposal_num, 0, 0, NULL);
+                }
                 char ts[32], buf[128];
                 timestamp(ts, sizeof(ts));
                 snprintf(buf, sizeof(buf), "%s,%d,%d,RECV_PREPARE,%d,\n", ts, node_id, r.from_id, r.proposal_num);
                 send_monitor(buf);
-
-                msg prom = { PROMISE, node_id, r.proposal_num, accepted_value };
-                send_msg(r.from_id, &prom);
-            } else if (r.type == ACCEPT) {
-                // recebeu ACCEPT valida o valor e responde com ACCEPTED se for valido
-                int aceito = 0;
-                for (int i = 0; i < KNOWN_STATES; i++) {
-                    if (known_states[i] == r.proposal_val) {
-                        aceito = 1;
-                        break;
-                    }
-                }
-                if (aceito) {
-                    accepted_value = r.proposal_val;
-                    printf("[Node %d] Aceitou valor %d do lider %d (proposal_num=%d)\n", node_id, r.proposal_val, r.from_id, r.proposal_num);
-                    char ts[32], buf[128];
-                    timestamp(ts, sizeof(ts));
-                    snprintf(buf, sizeof(buf), "%s,%d,%d,RECV_ACCEPT,%d,%d\n", ts, node_id, r.from_id, r.proposal_num, r.proposal_val);
-                    send_monitor(buf);
-                    
-                    // envia a mensagem de accepted
-                    msg accd = { ACCEPTED, node_id, r.proposal_num, accepted_value };
-                    send_msg(r.from_id, &accd);
-
-                    printf("[Node %d] Enviou ACCEPTED para o lider %d (proposal_num=%d, valor=%d)\n", node_id, r.from_id, r.proposal_num, accepted_value);
-                    timestamp(ts, sizeof(ts));
-                    snprintf(buf, sizeof(buf), "%s,%d,%d,SEND_ACCEPTED,%d,%d\n", ts, node_id, r.from_id, r.proposal_num, accepted_value);
-                    send_monitor(buf);
-                } else {
-                    printf("[Node %d] Rejeitou valor %d do lider %d (proposal_num=%d)\n", node_id, r.proposal_val, r.from_id, r.proposal_num);
+                promise_page(node_id, g, &r);
+            } else if (r.type == HEARTBEAT) {
+                // rodada de renovacao do lease: confirma se pode conceder
+                if (lease_grant(g, r.from_id, r.proposal_val)) {
+                    msg ack = { LEASE_ACK, node_id, r.proposal_num, 0, 0, g->id };
+                    send_msg(r.from_id, &ack);
                 }
+            } else if (r.type == DECIDED) {
+                // lider avisou ate onde o log esta decidido
+                learn_decided(node_id, g, r.proposal_num, r.proposal_val);
+                catchup_note(g, r.from_id, r.proposal_val);
+            } else if (r.type >= CATCHUP_VALUE && r.type <= CATCHUP_DATA) {
+                catchup_on_msg(node_id, g, &r);
+            } else if (r.type == ACCEPT_VALUE) {
+                on_accept_value(g, &r);
+            } else if (r.type == ACCEPT) {
+                on_accept(node_id, g, &r);
             }
         }
-        
-        usleep(10000);
+    }
+    return NULL;
+}
+
+// grava em segundo plano o snapshot de cada grupo que aplicou snapshot_every instancias desde o ultimo
+// (ou SNAPSHOT_FORCE, antes que os segmentos mapeados acabem); a thread paxos so e parada pelo tempo
+// de copiar o estado e compacta depois, no topo do laco, os segmentos cobertos
+void *snapshotter(void *arg) {
+    int node_id = (int)(intptr_t)arg;
+    while (1) {
+        usleep(SNAPSHOT_CHECK_MS * 1000);
+        int gravou = 0;
+        for (int gi = 0; gi < ngroups; gi++) {
+            paxos_group *g = &grp[gi];
+            int32_t *words = NULL;
+            int nwords = 0;
+            pthread_mutex_lock(&g->store_mtx);
+            int snap = g->snap_index;
+            pthread_mutex_unlock(&g->store_mtx);
+            pthread_mutex_lock(&g->state_mtx);
+            int index = g->applied_index;
+            int desde = index - snap;
+            if ((snapshot_every > 0 && desde >= snapshot_every) || desde >= SNAPSHOT_FORCE) words = sm->save(g, &nwords);
+            pthread_mutex_unlock(&g->state_mtx);
+            if (!words) continue;
+            // com store_mtx o snapshot recebido pelo catch-up na thread paxos nao grava o mesmo arquivo ao mesmo
+            // tempo; se ele chegou a um index maior enquanto o estado era copiado, este fica velho e nao e gravado
+            pthread_mutex_lock(&g->store_mtx);
+            int r = index > g->snap_index ? snap_write(node_id, gi, index, words, nwords) : -1;
+            if (r == 0) g->snap_index = index;
+            pthread_mutex_unlock(&g->store_mtx);
+            free(words);
+            if (r < 0) continue;
+            gravou = 1;
+        }
+        // o log aplicado ate o snapshot esta no disco: o WAL comeca um arquivo novo e o antigo sai quando
+        // todo grupo tiver regravado nele o que ainda importa
+        if (gravou) wal_rotate(node_id);
+        wal_retire(node_id);
+    }
+    return NULL;
+}
+
+// manda a to ate max palavras do snapshot gravado do grupo a partir da palavra off, lidas do arquivo;
+// se o snapshot no disco nao e o index que o pedido estava recebendo, recomeca da palavra 0
+// retorna quantas palavras foram
+int snap_send(int node_id, paxos_group *g, int to, int index, int off, int max) {
+    char path[256];
+    snap_path(path, sizeof(path), node_id, g->id, "dat");
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    snapshot_header h;
+    int32_t words[CATCHUP_CHUNK_MSGS];
+    int n = 0;
+    if (pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h)) {
+        if (h.index != index || off < 0 || off > h.nwords) off = 0;
+        n = h.nwords - off < max ? h.nwords - off : max;
+        size_t tam = sizeof(int32_t) * n;
+        if (n > 0 && pread(fd, words, tam, sizeof(h) + sizeof(int32_t) * off) != (ssize_t)tam) n = 0;
+        msg snap = { CATCHUP_SNAP, node_id, h.nwords, (int)h.sum, h.index, g->id };
+        send_msg(to, &snap);
+        for (int i = 0; i < n; i++) {
+            msg d = { CATCHUP_DATA, node_id, off + i, words[i], h.index, g->id };
+            send_msg(to, &d);
+        }
+    }
+    close(fd);
+    return n;
+}
+
+// manda a to um pedaco do log decidido a partir de req->slot, lido direto dos segmentos, ate CATCHUP_CHUNK_MSGS
+// mensagens; se o log ja foi compactado o pedaco e do snapshot. retorna quantas instancias (ou palavras) foram
+int catchup_send(int node_id, paxos_group *g, int to, const msg *req) {
+    pthread_mutex_lock(&g->state_mtx);
+    int ate = g->applied_index; // segmentos ate aqui ja estao mapeados
+    pthread_mutex_unlock(&g->state_mtx);
+    int msgs = 0, n = 0, slot = req->slot;
+    pthread_mutex_lock(&g->store_mtx);
+    const store_entry *e = slot <= ate ? store_get(g, slot) : NULL;
+    if (!e && slot <= g->snap_index) {
+        // o pedido seguinte ao ultimo pedaco do snapshot ja sai do log, a partir da instancia dele
+        n = snap_send(node_id, g, to, req->proposal_val, req->proposal_num, CATCHUP_CHUNK_MSGS - 2);
+    }
+    while (e && msgs + 1 + e->nvals <= CATCHUP_CHUNK_MSGS) {
+        for (int i = 0; i < e->nvals; i++) {
+            msg v = { CATCHUP_VALUE, node_id, i, e->vals[i], e->slot, g->id };
+            send_msg(to, &v);
+        }
+        msg ent = { CATCHUP_ENTRY, node_id, 0, e->nvals, e->slot, g->id };
+        send_msg(to, &ent);
+        msgs += 1 + e->nvals;
+        n++;
+        slot = e->slot + 1;
+        if (slot > ate) break;
+        // em sequencia no mapeamento; depois de um snapshot recebido pode haver salto, ai vai pelo indice
+        e = store_next(g, e);
+        if (!e || e->slot != slot) e = store_get(g, slot);
+    }
+    pthread_mutex_unlock(&g->store_mtx);
+    msg end = { CATCHUP_END, node_id, 0, ate, slot, g->id };
+    send_msg(to, &end);
+    return n;
+}
+
+// responde a candidatura de um node que voltou depois da eleicao, senao ele esperaria para sempre
+// thread propria: o catch-up espera a fila do vizinho esvaziar e nao pode atrasar a resposta
+void *late_election(void *arg) {
+    int node_id = (int)(intptr_t)arg;
+    while (1) {
+        msg r;
+        dequeue(&late_q, &r);
+        if (node_id == leader_id) {
+            msg coord = { COORDINATOR, node_id, 0, leader_id, 0, 0 };
+            send_msg(r.from_id, &coord);
+            printf("[Node %d] candidatura do node %d depois da eleicao, respondida com o lider %d\n", node_id, r.from_id, leader_id);
+        }
+        // seguidor descarta: numa eleicao de verdade este node tambem vai se candidatar e o candidato
+        // reenvia a candidatura; guardada, ela seria lida na proxima eleicao com o numero antigo
+    }
+    return NULL;
+}
+
+// atende os pedidos de catch-up dos nodes atrasados, fora da thread paxos: um pedaco por pedido,
+// so com a fila de saida do vizinho ate a marca baixa e no maximo catchup_rate instancias por segundo
+void *catchup_server(void *arg) {
+    int node_id = (int)(intptr_t)arg;
+    while (1) {
+        msg r;
+        dequeue(&catchup_q, &r);
+        if (catchup_rate <= 0 || r.from_id < 1 || r.from_id > NODES || r.from_id == node_id) continue;
+        while (peer_backlog(r.from_id) > outq_low && peer_health(r.from_id) != PEER_DOWN) usleep(1000);
+        long inicio = now_us();
+        int n = catchup_send(node_id, &grp[r.group], r.from_id, &r);
+        long resta = n * 1000000L / catchup_rate - (now_us() - inicio);
+        if (resta > 0) usleep(resta);
+    }
+    return NULL;
+}
+
+// relatorio de vazao a cada stats_ms: comandos aplicados por segundo em cada grupo, que com lotes
+// e a medida que importa (uma instancia leva ate ENTRY_MAX_VALUES / cmd_len comandos)
+// junto sai quantas mensagens o transporte levou e trouxe por segundo, que e o que o bench.sh compara
+void *apply_stats(void *arg) {
+    int node_id = (int)(intptr_t)arg;
+    long cmds[MAX_GROUPS] = {0}, insts[MAX_GROUPS] = {0}, antes = now_ms();
+    long enviadas = atomic_load(&msgs_sent), recebidas = atomic_load(&msgs_recv);
+    for (int gi = 0; gi < ngroups; gi++) {
+        pthread_mutex_lock(&grp[gi].state_mtx);
+        cmds[gi] = grp[gi].applied_cmds;
+        insts[gi] = grp[gi].applied_index;
+        pthread_mutex_unlock(&grp[gi].state_mtx);
+    }
+    while (1) {
+        usleep(stats_ms * 1000);
+        long agora = now_ms(), dt = agora - antes > 0 ? agora - antes : 1;
+        antes = agora;
+        long e = atomic_load(&msgs_sent), r = atomic_load(&msgs_recv);
+        if (e != enviadas || r != recebidas)
+            printf("[Node %d] transporte %s: %ld mensagens enviadas/s, %ld recebidas/s\n",
+                   node_id, transport_names[transport], (e - enviadas) * 1000 / dt, (r - recebidas) * 1000 / dt);
+        enviadas = e;
+        recebidas = r;
+        for (int gi = 0; gi < ngroups; gi++) {
+            pthread_mutex_lock(&grp[gi].state_mtx);
+            long c = grp[gi].applied_cmds, i = grp[gi].applied_index;
+            pthread_mutex_unlock(&grp[gi].state_mtx);
+            if (c == cmds[gi] && i == insts[gi]) continue; // grupo parado nao polui a saida
+            printf("[Node %d] grupo %d: %ld comandos aplicados/s, %ld instancias/s (maquina %s, instancia %ld)\n",
+                   node_id, gi, (c - cmds[gi]) * 1000 / dt, (i - insts[gi]) * 1000 / dt, sm->name, i);
+            cmds[gi] = c;
+            insts[gi] = i;
+        }
     }
     return NULL;
 }
 
 // thread que envia periodicamente heartbeats do lider para os outros nodes
+// so manda para quem nao recebeu nada do lider nos ultimos HEARTBEAT_MS,
+// PREPARE/ACCEPT ja contam como sinal de vida
+// perto de o lease vencer o heartbeat leva uma rodada de renovacao e vai para todos os vizinhos no ar
+// cada grupo liderado por este node renova o proprio lease; heartbeat de enlace ocioso e so do grupo 0
 void *heartbeat_sender(void *arg) {
     int node_id = (int)(intptr_t)arg;
     while (1) {
-        if (node_id == leader_id && election_done) {
-            msg hb = { HEARTBEAT, node_id, 0, 0 };
+        for (int gi = 0; gi < ngroups && election_done; gi++) {
+            // no modo mencius nao ha lease e todo node manda heartbeat, a revogacao depende disso
+            if (node_id != group_leader(gi) && !(mencius && gi == 0)) continue;
+            long agora = now_ms();
+            // a rodada de lease leva o mandato: o seguidor nao concede a um lider que outro ja substituiu
+            int ballot = grp[gi].leader_ballot;
+            int round = mencius || ballot == 0 ? 0 : lease_start_round(&grp[gi], agora);
+            if (round == 0 && gi != 0) continue;
+            pthread_mutex_lock(&grp[gi].state_mtx);
+            int aplicado = grp[gi].applied_index; // quem ficou para tras descobre pelo heartbeat
+            pthread_mutex_unlock(&grp[gi].state_mtx);
+            msg hb = { HEARTBEAT, node_id, round, round > 0 ? ballot : 0, aplicado, gi };
+            int targets[NODES], n = 0;
             for (int i = 1; i <= NODES; i++) {
-                if (i != node_id) send_msg(i, &hb); // envia heartbeat
+                if (i == node_id || peer_health(i) == PEER_DOWN) continue;
+                // vizinho congestionado ja tem mensagens na fila, heartbeat so pioraria
+                // vizinho fora do ar fica com a sondagem do disjuntor, heartbeat nao adianta
+                if (round > 0 || (agora - last_sent_ms[i] >= HEARTBEAT_MS && !peer_congested(i) &&
+                    peer_health(i) == PEER_UP)) targets[n++] = i;
             }
+            if (n > 0) send_to_peers(targets, n, &hb); // envia heartbeat
         }
-        sleep(1); 
+        usleep(HEARTBEAT_MS * 1000 / 2); // meio intervalo: enlace ocioso nunca passa de 1,5x sem sinal
     }
     return NULL;
 }
@@ -423,10 +4088,14 @@ void *leader_monitor(void *arg) {
     while (1) {
         if (election_done && node_id != leader_id) {
             time_t now = time(NULL);
-            if (last_heartbeat != 0 && now - last_heartbeat > 3) {
+            // enquanto o lease concedido vale o lider ainda pode responder leituras, nao elege outro
+            if (last_heartbeat != 0 && now - last_heartbeat > 3 && !lease_active(&grp[0])) {
                 printf("[Node %d] detectado lider %d falhou! chamando reeleicao...\n", node_id, leader_id);
+                // leader_id fica: ate a eleicao acabar, group_leader passa cada grupo ao proximo node no ar pelo breaker
+                // candidaturas e COORDINATOR que sobraram da eleicao anterior nao valem nesta
+                msg resto;
+                while (dequeue_timeout(&election_q, &resto, 0));
                 election_done = 0;
-                leader_id = -1;
                 last_heartbeat = 0;
                 pthread_t et;
                 pthread_create(&et, NULL, election, (void*)(intptr_t)node_id); // dispara nova eleicao
@@ -444,15 +4113,118 @@ int main(int argc, char **argv) {
     char *env = getenv("PAXOS_FAIL_CASE");
     if (env) fail_case = atoi(env);
 
-    queue_init(&inbox); // inicializa fila de mensagens
-    pthread_t lt, et, pt, hb, lm;
-    pthread_create(&lt, NULL, listener, (void*)(intptr_t)node_id); // thread listener
+    char *tenv = getenv("PAXOS_TRANSPORT");
+    if (tenv && strcmp(tenv, "udp") == 0) transport = TRANSPORT_UDP;
+    if (tenv && strcmp(tenv, "shm") == 0) transport = TRANSPORT_SHM;
+    if (tenv && strcmp(tenv, "uring") == 0) transport = TRANSPORT_URING;
+    char *hi = getenv("PAXOS_OUTQ_HIGH"), *lo = getenv("PAXOS_OUTQ_LOW");
+    if (hi) outq_high = atoi(hi);
+    if (lo) outq_low = atoi(lo);
+    if (outq_high < 1 || outq_high > OUTQ_CAPACITY || outq_low < 0 || outq_low >= outq_high) {
+        printf("[Node %d] marcas da fila de saida invalidas (%d/%d), usando %d/%d\n",
+               node_id, outq_high, outq_low, OUTQ_CAPACITY * 3 / 4, OUTQ_CAPACITY / 4);
+        outq_high = OUTQ_CAPACITY * 3 / 4;
+        outq_low = OUTQ_CAPACITY / 4;
+    }
+    char *wenv = getenv("PAXOS_WINDOW");
+    if (wenv) window = atoi(wenv);
+    char *benv = getenv("PAXOS_BATCH"), *bmsenv = getenv("PAXOS_BATCH_MS");
+    if (benv) batch_max = atoi(benv);
+    char *thenv = getenv("PAXOS_THRIFTY");
+    if (thenv) thrifty = atoi(thenv) != 0;
+    if (bmsenv) batch_ms = atoi(bmsenv);
+    if (batch_max < 1 || batch_max > ENTRY_MAX_VALUES || batch_ms < 0) {
+        printf("[Node %d] lote invalido (%d valores, %d ms), usando %d valores sem espera\n", node_id, batch_max, batch_ms, ENTRY_MAX_VALUES);
+        batch_max = ENTRY_MAX_VALUES;
+        batch_ms = 0;
+    }
+    char *q1env = getenv("PAXOS_Q1"), *q2env = getenv("PAXOS_Q2");
+    if (q1env) q1 = atoi(q1env);
+    if (q2env) q2 = atoi(q2env);
+    if (q1 < 1 || q2 < 1 || q1 > NODES || q2 > NODES || q1 + q2 <= NODES) {
+        printf("[Node %d] quoruns invalidos (q1=%d, q2=%d, precisa q1 + q2 > %d), usando maioria\n", node_id, q1, q2, NODES);
+        q1 = q2 = NODES/2 + 1;
+    }
+    if (window < 1 || window > LOG_CAPACITY / 2) {
+        printf("[Node %d] janela invalida (%d), usando %d\n", node_id, window, DEFAULT_WINDOW);
+        window = DEFAULT_WINDOW;
+    }
+    char *wsenv = getenv("PAXOS_WAL_SYNC");
+    if (wsenv && strcmp(wsenv, "off") == 0) wal_sync = WAL_OFF;
+    else if (wsenv && strcmp(wsenv, "write") == 0) wal_sync = WAL_WRITE;
+    else if (wsenv && strcmp(wsenv, "fsync") != 0) printf("[Node %d] politica do WAL invalida (%s), usando fsync\n", node_id, wsenv);
+    char *cenv = getenv("PAXOS_CATCHUP_RATE");
+    if (cenv) catchup_rate = atoi(cenv);
+    char *senv = getenv("PAXOS_SNAPSHOT_EVERY");
+    if (senv) snapshot_every = atoi(senv);
+    char *smenv = getenv("PAXOS_SM");
+    if (smenv && strcmp(smenv, "kv") == 0) sm = &kv_sm;
+    else if (smenv && strcmp(smenv, "register") != 0) printf("[Node %d] maquina de estados invalida (%s), usando register\n", node_id, smenv);
+    char *stenv = getenv("PAXOS_STATS_MS");
+    if (stenv) stats_ms = atoi(stenv);
+    char *menv = getenv("PAXOS_MENCIUS");
+    if (menv) mencius = atoi(menv) != 0;
+    if (mencius && thrifty) {
+        printf("[Node %d] modo thrifty nao vale no modo mencius, cada lote vai para todos\n", node_id);
+        thrifty = 0;
+    }
+    if (transport == TRANSPORT_URING && uring_init() < 0) {
+        perror("[Node] io_uring indisponivel, usando tcp com epoll");
+        transport = TRANSPORT_TCP;
+    }
+
+    signal(SIGPIPE, SIG_IGN); // escrita em conexao fechada vira erro e nao derruba o node
+    char *genv = getenv("PAXOS_GROUPS");
+    if (genv) ngroups = atoi(genv);
+    if (ngroups < 1 || ngroups > MAX_GROUPS) {
+        printf("[Node %d] numero de grupos invalido (%d), usando 1\n", node_id, ngroups);
+        ngroups = 1;
+    }
+    for (int i = 0; i < ngroups; i++) group_init(&grp[i], i); // log, filas e lease de cada grupo
+    for (int i = 1; i <= NODES; i++) last_recv_ms[i] = now_ms(); // ninguem e dado como parado antes de poder falar
+    wal_open(node_id); // estado dos acceptors de uma execucao anterior
+    for (int i = 0; i < ngroups; i++) {
+        snap_open(node_id, &grp[i]); // snapshot de uma execucao anterior
+        store_open(node_id, &grp[i]); // log decidido depois do snapshot
+    }
+    peers_init(); // inicializa pool de conexoes com os outros nodes
+    queue_init(&catchup_q);
+    queue_init(&late_q);
+    queue_init(&election_q);
+    queue_init(&reply_q);
+    pthread_t lt, et, pt[MAX_GROUPS], hb, lm, io, wt, st, cu, sa, le, cr;
+    pthread_create(&io, NULL, peer_io, (void*)(intptr_t)node_id); // thread que esvazia as filas de saida
+    if (wal_sync != WAL_OFF) pthread_create(&wt, NULL, wal_flusher, (void*)(intptr_t)node_id); // thread que grava o WAL
+    if (transport == TRANSPORT_UDP) {
+        udp_init(node_id);
+        pthread_create(&lt, NULL, udp_listener, (void*)(intptr_t)node_id); // thread listener udp
+    } else if (transport == TRANSPORT_SHM) {
+        shm_init();
+        pthread_create(&lt, NULL, shm_listener, (void*)(intptr_t)node_id); // thread listener shm
+    } else if (transport == TRANSPORT_URING) {
+        pthread_create(&lt, NULL, uring_listener, (void*)(intptr_t)node_id); // thread listener io_uring
+    } else {
+        pthread_create(&lt, NULL, listener, (void*)(intptr_t)node_id); // thread listener
+    }
     pthread_create(&et, NULL, election, (void*)(intptr_t)node_id); // thread eleição
-    pthread_create(&pt, NULL, paxos, (void*)(intptr_t)node_id); // thread paxos
+    for (int i = 0; i < ngroups; i++) {
+        group_thread *gt = malloc(sizeof(*gt));
+        gt->node_id = node_id;
+        gt->g = &grp[i];
+        pthread_create(&pt[i], NULL, paxos, gt); // thread paxos do grupo
+    }
+    pthread_t ct;
+    pthread_create(&ct, NULL, client_listener, (void*)(intptr_t)node_id); // propostas do cliente, em todo node
+    pthread_detach(ct);
     pthread_create(&hb, NULL, heartbeat_sender, (void*)(intptr_t)node_id); // thread heartbeat
     pthread_create(&lm, NULL, leader_monitor, (void*)(intptr_t)node_id); // thread monitorar lider
+    pthread_create(&cu, NULL, catchup_server, (void*)(intptr_t)node_id); // log para os nodes atrasados
+    pthread_create(&le, NULL, late_election, (void*)(intptr_t)node_id); // candidaturas depois da eleicao
+    pthread_create(&cr, NULL, client_replier, NULL); // respostas ao cliente
+    pthread_create(&st, NULL, snapshotter, (void*)(intptr_t)node_id); // snapshots e compactacao (com 0 so o forcado)
+    if (stats_ms > 0) pthread_create(&sa, NULL, apply_stats, (void*)(intptr_t)node_id); // vazao da maquina de estados
     pthread_join(lt, NULL);
     pthread_join(et, NULL);
-    pthread_join(pt, NULL);
+    for (int i = 0; i < ngroups; i++) pthread_join(pt[i], NULL);
     return 0;
 }
\ No newline at end of file